@@ -0,0 +1,118 @@
+#include <inttypes.h>
+#include "nvs_flash.h"
+#include "esp_netif.h"
+#include "zh_network.h"
+
+#define BENCHMARK_ECHO_NODE 0 // 1 - the node only sends the received round trip time messages back.
+#define BENCHMARK_COUNT 200
+#define BENCHMARK_ECHO_MARKER 0xEC // First byte of the round trip time messages. The echo node sends back only these messages.
+
+uint8_t target[6] = {0x58, 0xBF, 0x25, 0x18, 0xC8, 0x04}; // MAC of the echo node. Change it to the MAC of your echo node.
+const uint8_t payload_size[] = {8, 64, 128, ZH_NETWORK_MAX_MESSAGE_SIZE};
+volatile uint32_t recv_count = 0;
+volatile int64_t recv_time = 0;
+volatile uint32_t send_success_count = 0;
+volatile uint32_t send_fail_count = 0;
+
+void zh_network_recv_cb(const uint8_t *mac_addr, const uint8_t *data, const uint16_t data_len)
+{
+    if (data_len == 0 || data[0] != BENCHMARK_ECHO_MARKER)
+    {
+        return; // Unicast and broadcast throughput messages.
+    }
+#if BENCHMARK_ECHO_NODE
+    zh_network_send_ex(mac_addr, data, data_len, ZH_NETWORK_DELIVERY_HOP, NULL);
+#else
+    recv_time = esp_timer_get_time();
+    ++recv_count;
+#endif
+}
+
+void zh_network_send_cb(const zh_network_event_on_send_t *on_send, void *arg)
+{
+    if (on_send->status == ZH_NETWORK_SEND_SUCCESS)
+    {
+        ++send_success_count;
+    }
+    else
+    {
+        ++send_fail_count;
+    }
+}
+
+uint32_t benchmark_send(const uint8_t *target, const uint8_t *data, const uint8_t data_len)
+{
+    send_success_count = 0;
+    send_fail_count = 0;
+    int64_t time = esp_timer_get_time();
+    for (uint16_t i = 0; i < BENCHMARK_COUNT;)
+    {
+        if (zh_network_send_ex(target, data, data_len, ZH_NETWORK_DELIVERY_CONFIRMED, NULL) == ESP_OK)
+        {
+            ++i;
+            continue;
+        }
+        vTaskDelay(1); // The queue is full.
+    }
+    while (send_success_count + send_fail_count < BENCHMARK_COUNT && esp_timer_get_time() - time < 30000000)
+    {
+        vTaskDelay(1);
+    }
+    return (uint32_t)((uint64_t)send_success_count * data_len * 1000000 / (esp_timer_get_time() - time));
+}
+
+void app_main(void)
+{
+    esp_log_level_set("zh_network", ESP_LOG_NONE);
+    nvs_flash_init();
+    esp_netif_init();
+    esp_event_loop_create_default();
+    wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
+    esp_wifi_init(&wifi_init_config);
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    esp_wifi_start();
+    zh_network_init_config_t network_init_config = ZH_NETWORK_INIT_CONFIG_DEFAULT();
+    zh_network_init(&network_init_config);
+    zh_network_register_recv_cb(&zh_network_recv_cb);
+    zh_network_register_send_cb(&zh_network_send_cb, NULL);
+    if (BENCHMARK_ECHO_NODE)
+    {
+        return;
+    }
+    vTaskDelay(5000 / portTICK_PERIOD_MS);
+    uint8_t data[ZH_NETWORK_MAX_MESSAGE_SIZE] = {0};
+    for (uint8_t i = 0; i < sizeof(payload_size); ++i)
+    {
+        int64_t rtt_sum = 0;
+        int64_t rtt_max = 0;
+        uint16_t rtt_count = 0;
+        data[0] = BENCHMARK_ECHO_MARKER;
+        for (uint16_t j = 0; j < BENCHMARK_COUNT; ++j)
+        {
+            uint32_t count = recv_count;
+            int64_t time = esp_timer_get_time();
+            zh_network_send_ex(target, data, payload_size[i], ZH_NETWORK_DELIVERY_HOP, NULL);
+            while (recv_count == count && esp_timer_get_time() - time < 1000000)
+            {
+                vTaskDelay(1);
+            }
+            if (recv_count != count)
+            {
+                rtt_sum += recv_time - time;
+                rtt_max = (recv_time - time > rtt_max) ? recv_time - time : rtt_max;
+                ++rtt_count;
+            }
+        }
+        data[0] = 0;
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        uint32_t unicast = benchmark_send(target, data, payload_size[i]);
+        uint32_t unicast_fail = send_fail_count;
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        uint32_t broadcast = benchmark_send(NULL, data, payload_size[i]);
+        printf("Payload %d bytes. RTT average %" PRId64 " us, maximum %" PRId64 " us, lost %d of %d. Unicast %" PRIu32 " bytes/s, failed %" PRIu32 ". Broadcast %" PRIu32 " bytes/s.\n", payload_size[i], (rtt_count == 0) ? 0 : rtt_sum / rtt_count, rtt_max, BENCHMARK_COUNT - rtt_count, BENCHMARK_COUNT, unicast, unicast_fail, broadcast);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    }
+    zh_network_stats_t stats = {0};
+    zh_network_get_stats(&stats);
+    printf("Send retries %" PRIu32 ", send fail %" PRIu32 ", route discoveries %" PRIu32 ", queue high water %" PRIu32 ".\n", stats.send_retries, stats.send_fail, stats.route_discoveries, stats.queue_high_water);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "stdio.h"
 #include "string.h"
 #include "esp_err.h"
 #include "esp_timer.h"
@@ -9,7 +10,7 @@
 #include "freertos/event_groups.h"
 #include "esp_log.h"
 #include "esp_heap_caps.h"
-#include "zh_vector.h"
+#include "nvs.h"
 #ifdef CONFIG_IDF_TARGET_ESP8266
 #include "esp_system.h"
 #else
@@ -18,19 +19,45 @@
 #endif
 
 #define ZH_NETWORK_MAX_MESSAGE_SIZE 218 // Maximum value of the transmitted data size. @attention All devices on the network must have the same ZH_NETWORK_MAX_MESSAGE_SIZE.
+#define ZH_NETWORK_LATENCY_BUCKETS 24 // Number of buckets of latency histograms.
 
-#define ZH_NETWORK_INIT_CONFIG_DEFAULT() \
-    {                                    \
-        .network_id = 0xFAFBFCFD,        \
-        .task_priority = 4,              \
-        .stack_size = 3072,              \
-        .queue_size = 32,                \
-        .max_waiting_time = 1000,        \
-        .id_vector_size = 100,           \
-        .route_vector_size = 100,        \
-        .wifi_interface = WIFI_IF_STA,   \
-        .wifi_channel = 1,               \
-        .attempts = 3                    \
+#define ZH_NETWORK_INIT_CONFIG_DEFAULT()       \
+    {                                          \
+        .network_id = 0xFAFBFCFD,              \
+        .task_priority = 4,                    \
+        .stack_size = 3072,                    \
+        .task_core_id = -1,                    \
+        .queue_size = 32,                      \
+        .queue_high_watermark = 0,             \
+        .queue_low_watermark = 0,              \
+        .max_waiting_time = 1000,              \
+        .id_vector_size = 100,                 \
+        .route_vector_size = 100,              \
+        .wifi_interface = WIFI_IF_STA,         \
+        .wifi_channel = 1,                     \
+        .attempts = 3,                         \
+        .send_window = 4,                      \
+        .route_lifetime = 600,                 \
+        .route_save_interval = 0,              \
+        .discovery_timeout = 250,              \
+        .max_hops = 32,                        \
+        .flood_mode = ZH_NETWORK_FLOOD_ALWAYS, \
+        .flood_counter_threshold = 3,          \
+        .flood_max_delay = 20,                 \
+        .flood_probability = 65,               \
+        .flood_table_size = 16,                \
+        .rx_queue_size = 32,                   \
+        .control_queue_size = 16,              \
+        .confirm_queue_size = 16,              \
+        .forward_queue_size = 32,              \
+        .forward_rate_limit = 0,               \
+        .data_pool_size = 0,                   \
+        .fragment_table_size = 2,              \
+        .fragment_timeout = 3000,              \
+        .aggregate_linger = 0,                 \
+        .group_table_size = 8,                 \
+        .compact_header = false,               \
+        .ack_delay = 10                        \
     }
 
 #ifdef __cplusplus
@@ -38,18 +65,57 @@ extern "C"
 {
 #endif
 
+    typedef enum // Enumeration of possible modes of resending broadcast and routing messages to all nodes.
+    {
+        ZH_NETWORK_FLOOD_ALWAYS,  // Every node resends every new message once.
+        ZH_NETWORK_FLOOD_COUNTER, // A node waits a random delay and resends the message only if it heard fewer copies than flood_counter_threshold.
+        ZH_NETWORK_FLOOD_GOSSIP   // A node resends the message with the flood_probability probability.
+    } zh_network_flood_mode_t;
+
+    typedef enum // Enumeration of possible delivery modes of unicast messages.
+    {
+        ZH_NETWORK_DELIVERY_CONFIRMED, // The message is sent success after the delivery confirmation from the target node is received.
+        ZH_NETWORK_DELIVERY_HOP,       // The message is sent success after the next node acknowledges the receiving. The target node does not send the delivery confirmation.
+        ZH_NETWORK_DELIVERY_NONE       // The message is sent once without resending and without the sending status event. A failed message does not delete the route.
+    } zh_network_delivery_mode_t;
+
     typedef struct // Structure for initial initialization of ESP-NOW interface.
     {
-        uint32_t network_id;             // A unique ID for the mesh network. @attention The ID must be the same for all nodes in the network.
-        uint8_t task_priority;           // Task priority for the ESP-NOW messages processing. @note It is not recommended to set a value less than 4.
-        uint16_t stack_size;             // Stack size for task for the ESP-NOW messages processing. @note The minimum size is 3072 bytes.
-        uint8_t queue_size;              // Queue size for task for the ESP-NOW messages processing. @note The size depends on the number of messages to be processed. It is not recommended to set the value less than 32.
-        uint16_t max_waiting_time;       // Maximum time to wait a response message from target node (in milliseconds). @note If a response message from the target node is not received within this time, the status of the sent message will be "sent fail".
-        uint16_t id_vector_size;         // Maximum size of unique ID of received messages. @note If the size is exceeded, the first value will be deleted. Minimum recommended value: number of planned nodes in the network + 10%.
-        uint16_t route_vector_size;      // The maximum size of the routing table. @note If the size is exceeded, the first route will be deleted. Minimum recommended value: number of planned nodes in the network + 10%.
-        wifi_interface_t wifi_interface; // WiFi interface (STA or AP) used for ESP-NOW operation. @note The MAC address of the device depends on the selected WiFi interface.
-        uint8_t wifi_channel;            // Wi-Fi channel uses to send/receive ESPNOW data. @note Values from 1 to 14.
-        uint8_t attempts;                // Maximum number of attempts to send a message. @note It is not recommended to set a value greater than 5.
+        uint32_t network_id;                // A unique ID for the mesh network. @attention The ID must be the same for all nodes in the network.
+        uint8_t task_priority;              // Task priority for the ESP-NOW messages processing. @note It is not recommended to set a value less than 4.
+        uint16_t stack_size;                // Stack size for task for the ESP-NOW messages processing. @note The minimum size is 3072 bytes.
+        int8_t task_core_id;                // Core for the task for the ESP-NOW messages processing. @note -1 - the task is not pinned to a core. Ignored on ESP8266.
+        uint8_t queue_size;                 // Queue size for outgoing messages of the application. @note The size depends on the number of messages to be sent. It is not recommended to set the value less than 32. The same size is used for the table of messages waiting for routing or delivery confirmation.
+        uint8_t queue_high_watermark;       // Number of messages in the queue for outgoing messages of the application for posting the ZH_NETWORK_QUEUE_HIGH event. @note 0 - the events are not posted. Must not be greater than queue_size.
+        uint8_t queue_low_watermark;        // Number of messages in the queue for outgoing messages of the application for posting the ZH_NETWORK_QUEUE_LOW event after the ZH_NETWORK_QUEUE_HIGH event. @note Must be less than queue_high_watermark.
+        uint16_t max_waiting_time;          // Maximum time to wait a response message from target node (in milliseconds). @note If a response message from the target node is not received within this time, the status of the sent message will be "sent fail".
+        uint16_t id_vector_size;            // Maximum number of nodes tracked for repeat message detection. @note If the size is exceeded, the least recently heard node will be replaced. Minimum recommended value: number of planned nodes in the network + 10%.
+        uint16_t route_vector_size;         // The maximum size of the routing table. @note If the size is exceeded, the least recently refreshed route will be replaced. Minimum recommended value: number of planned nodes in the network + 10%.
+        wifi_interface_t wifi_interface;    // WiFi interface (STA or AP) used for ESP-NOW operation. @note The MAC address of the device depends on the selected WiFi interface.
+        uint8_t wifi_channel;               // Wi-Fi channel uses to send/receive ESPNOW data. @note Values from 1 to 14.
+        uint8_t attempts;                   // Maximum number of attempts to send a message. @note It is not recommended to set a value greater than 5.
+        uint8_t send_window;                // Maximum number of messages sent at the same time and waiting for the send result. @note Messages to different next hops are sent without waiting for each other. The minimum value is 1.
+        uint16_t route_lifetime;            // Maximum time a route is kept without being refreshed (in seconds). @note After this time a new route search will be performed.
+        uint16_t route_save_interval;       // Minimum time between saving of the changed routing table to NVS (in seconds). @note 0 - the routing table is not saved. The saved routes are loaded at initialization and used until they are confirmed or replaced. NVS must be initialized by the application before zh_network_init().
+        uint16_t discovery_timeout;         // Time to wait a routing response before repeating the routing request (in milliseconds). @note The waiting time doubles with each repeated request. All messages to the same node share one routing request.
+        uint8_t max_hops;                   // Maximum number of hops for a message. @note Messages that have passed this number of hops are not resent or forwarded.
+        zh_network_flood_mode_t flood_mode; // Mode of resending broadcast and routing messages to all nodes. @note ZH_NETWORK_FLOOD_COUNTER or ZH_NETWORK_FLOOD_GOSSIP reduce the number of transmissions in dense networks.
+        uint8_t flood_counter_threshold;    // Number of heard copies of a message after which the message is not resent. @note Used only with ZH_NETWORK_FLOOD_COUNTER.
+        uint16_t flood_max_delay;           // Maximum random delay before resending a message (in milliseconds). @note Used only with ZH_NETWORK_FLOOD_COUNTER.
+        uint8_t flood_probability;          // Probability of resending a message (in percent). @note Used only with ZH_NETWORK_FLOOD_GOSSIP. Values from 1 to 100.
+        uint8_t flood_table_size;           // Maximum number of messages waiting the random delay before resending. @note Used only with ZH_NETWORK_FLOOD_COUNTER. If the table is full the message is resent without the delay.
+        uint8_t rx_queue_size;              // Queue size for incoming messages waiting for processing. @note Incoming messages are discarded if the queue is full.
+        uint8_t control_queue_size;         // Queue size for outgoing routing request and routing response messages. @note This queue is sent first.
+        uint8_t confirm_queue_size;         // Queue size for outgoing delivery confirmation messages. @note This queue is sent after the routing messages.
+        uint8_t forward_queue_size;         // Queue size for messages forwarded to other nodes. @note This queue is sent after the delivery confirmation messages and before the messages of the application. When the queue is at least half full, each original sender can hold only its share of the queue.
+        uint8_t forward_rate_limit;         // Maximum number of messages per second forwarded for each original sender. @note 0 - not limited. Bursts up to this number of messages are allowed.
+        uint8_t data_pool_size;             // Number of preallocated buffers for the data of received messages. @note 0 - the data is allocated in the heap. It is recommended to set the same value as queue_size. If there is no free buffer, the data is allocated in the heap.
+        uint8_t fragment_table_size;        // Maximum number of fragmented messages sent and received at the same time. @note 0 - zh_network_send_large() is limited to ZH_NETWORK_MAX_MESSAGE_SIZE.
+        uint16_t fragment_timeout;          // Maximum time to wait the next fragment of a fragmented message (in milliseconds). @note After this time the received fragments are discarded.
+        uint16_t aggregate_linger;          // Maximum time to hold small messages for packing with other messages to the same next node (in milliseconds). @note 0 - messages are not packed. Packed messages are unpacked by the next node. All devices on the network must support packed messages.
+        uint8_t group_table_size;           // Maximum number of groups the device can join. @note 0 - the device does not receive multicast messages. Multicast messages of other groups are only resent to all nodes.
+        bool compact_header;                // Send messages to the next node without the addresses if the next node is the original target. @note The header is reduced from 30 to 11 bytes. Resent and forwarded messages use the full header. All devices on the network must support compact headers.
+        uint16_t ack_delay;                 // Maximum time to hold a delivery confirmation for combining with confirmations of the next messages from the same node (in milliseconds). @note 0 - confirmations are sent immediately. Must be much less than max_waiting_time.
     } zh_network_init_config_t;
 
     ESP_EVENT_DECLARE_BASE(ZH_NETWORK);
@@ -57,7 +123,8 @@ extern "C"
     typedef enum // Enumeration of possible ESP-NOW events.
     {
         ZH_NETWORK_ON_RECV_EVENT, // The event when the ESP-NOW message was received.
-        ZH_NETWORK_ON_SEND_EVENT  // The event when the ESP-NOW message was sent.
+        ZH_NETWORK_ON_SEND_EVENT, // The event when the ESP-NOW message was sent.
+        ZH_NETWORK_ON_QUEUE_EVENT // The event when the queue for outgoing messages of the application reached a watermark.
     } zh_network_event_type_t;
 
     typedef enum // Enumeration of possible status of sent ESP-NOW message.
@@ -69,16 +136,86 @@ extern "C"
     typedef struct // Structure for sending data to the event handler when an ESP-NOW message was sent. @note Should be used with ZH_NETWORK event base and ZH_NETWORK_ON_SEND_EVENT event.
     {
         uint8_t mac_addr[6];                    // MAC address of the device to which the ESP-NOW message was sent.
+        uint32_t message_id;                    // ID of sent ESP-NOW message. @note The same ID is returned by zh_network_send_ex().
         zh_network_on_send_event_type_t status; // Status of sent ESP-NOW message.
     } zh_network_event_on_send_t;
 
+    typedef enum // Enumeration of possible watermarks of the queue for outgoing messages of the application.
+    {
+        ZH_NETWORK_QUEUE_HIGH, // The queue reached queue_high_watermark. The application should slow down sending.
+        ZH_NETWORK_QUEUE_LOW   // The queue dropped to queue_low_watermark. The application can resume sending.
+    } zh_network_on_queue_event_type_t;
+
+    typedef struct // Structure for sending data to the event handler when the queue for outgoing messages of the application reached a watermark. @note Should be used with ZH_NETWORK event base and ZH_NETWORK_ON_QUEUE_EVENT event.
+    {
+        zh_network_on_queue_event_type_t status; // Reached watermark.
+        uint8_t queue_used;                      // Number of messages in the queue.
+    } zh_network_event_on_queue_t;
+
     typedef struct // Structure for sending data to the event handler when an ESP-NOW message was received. @note Should be used with ZH_NETWORK event base and ZH_NETWORK_ON_RECV_EVENT event.
     {
         uint8_t mac_addr[6]; // MAC address of the sender ESP-NOW message.
-        uint8_t *data;       // Pointer to the data of the received ESP-NOW message.
-        uint8_t data_len;    // Size of the received ESP-NOW message.
+        uint8_t *data;       // Pointer to the data of the received ESP-NOW message. @attention Must be freed with zh_network_free_data() after use.
+        uint16_t data_len;   // Size of the received ESP-NOW message.
     } zh_network_event_on_recv_t;
 
+    typedef enum // Enumeration of ESP-NOW message types used for statistics.
+    {
+        ZH_NETWORK_BROADCAST,        // Broadcast message.
+        ZH_NETWORK_UNICAST,          // Unicast message.
+        ZH_NETWORK_DELIVERY_CONFIRM, // System message for message receiving confirmation.
+        ZH_NETWORK_SEARCH_REQUEST,   // System message for routing request.
+        ZH_NETWORK_SEARCH_RESPONSE,  // System message for routing response.
+        ZH_NETWORK_FRAGMENT,         // Fragment of a fragmented message.
+        ZH_NETWORK_FRAGMENT_CONFIRM, // System message for fragmented message receiving confirmation.
+        ZH_NETWORK_AGGREGATE,        // Frame with several messages packed for the same next node.
+        ZH_NETWORK_MULTICAST,        // Message to the members of a group.
+        ZH_NETWORK_MESSAGE_TYPE_MAX  // Number of message types.
+    } zh_network_message_type_t;
+
+    typedef struct // Structure for reading ESP-NOW statistics. @note Arrays are indexed by zh_network_message_type_t.
+    {
+        uint32_t sent[ZH_NETWORK_MESSAGE_TYPE_MAX];      // Number of messages sent success to the next node.
+        uint32_t received[ZH_NETWORK_MESSAGE_TYPE_MAX];  // Number of messages received and added to queue.
+        uint32_t forwarded[ZH_NETWORK_MESSAGE_TYPE_MAX]; // Number of messages added to queue for forwarding or resend to all nodes.
+        uint32_t duplicates_dropped;                     // Number of repeat messages discarded.
+        uint32_t routing_repeats;                        // Number of repeat routing messages added to queue for choosing the route with the lowest path cost.
+        uint32_t network_id_mismatch;                    // Number of messages with incorrect mesh network ID discarded.
+        uint32_t size_rejected;                          // Number of messages with incorrect size discarded.
+        uint32_t send_queue_full;                        // Number of zh_network_send() calls rejected because the queue is full.
+        uint32_t recv_queue_full;                        // Number of incoming messages discarded because the queue is full.
+        uint32_t internal_queue_full;                    // Number of forwarded or system messages discarded because the queue is full.
+        uint32_t forward_limited;                        // Number of forwarded messages discarded because the original sender exceeded its share of the queue or forward_rate_limit.
+        uint32_t send_fail;                              // Number of send attempts failed at the MAC layer.
+        uint32_t send_retries;                           // Number of repeated send attempts.
+        uint32_t route_discoveries;                      // Number of routing requests sent.
+        uint32_t route_hits;                             // Number of routing table lookups with a route found.
+        uint32_t route_misses;                           // Number of routing table lookups with no route found.
+        uint32_t response_timeouts;                      // Number of messages for which no confirmation message was received in time.
+        uint32_t route_timeouts;                         // Number of messages for which no route was found in time.
+        uint32_t queue_high_water;                       // Maximum number of messages in the queue for outgoing messages of the application.
+        uint32_t rx_queue_high_water;                    // Maximum number of messages in the queue for incoming messages.
+        uint32_t data_pool_exhausted;                    // Number of received messages whose data was allocated in the heap because of no free preallocated buffer.
+    } zh_network_stats_t;
+
+    typedef enum // Enumeration of measured stages of messages processing.
+    {
+        ZH_NETWORK_LATENCY_QUEUE,    // From adding a message to a queue to taking it from the queue for processing.
+        ZH_NETWORK_LATENCY_RADIO,    // From passing a message to ESP-NOW to receiving the sending status.
+        ZH_NETWORK_LATENCY_CONFIRM,  // From the last sending of a unicast message to receiving its delivery confirmation.
+        ZH_NETWORK_LATENCY_DELIVER,  // From receiving a message to passing it to the application.
+        ZH_NETWORK_LATENCY_STAGE_MAX // Number of stages.
+    } zh_network_latency_stage_t;
+
+    typedef struct // Structure for reading latency histograms. @note Arrays are indexed by zh_network_latency_stage_t and zh_network_message_type_t. Bucket N counts latencies from 2^N to 2^(N+1) - 1 microseconds, the last bucket counts all longer latencies.
+    {
+        uint32_t bucket[ZH_NETWORK_LATENCY_STAGE_MAX][ZH_NETWORK_MESSAGE_TYPE_MAX][ZH_NETWORK_LATENCY_BUCKETS]; // Number of messages in each latency bucket.
+    } zh_network_latency_t;
+
+    typedef void (*zh_network_send_cb_t)(const zh_network_event_on_send_t *on_send, void *arg); // Function for receiving the sending status of ESP-NOW messages without the event loop. @note Called from the ESP-NOW messages processing task. The status is valid only during the call.
+
+    typedef void (*zh_network_recv_cb_t)(const uint8_t *mac_addr, const uint8_t *data, const uint16_t data_len); // Function for receiving ESP-NOW messages without the event loop. @note Called from the ESP-NOW messages processing task. The data is valid only during the call and must not be freed.
+
     /**
      * @brief Initialize ESP-NOW interface.
      *
@@ -112,16 +249,209 @@ extern "C"
      * @param[in] data Pointer to a buffer containing the data for send.
      * @param[in] data_len Sending data length.
      *
-     * @note The function will return an ESP_ERR_INVALID_STATE error if less than 50% of the size set at initialization remains in the message queue.
+     * @note The function will return an ESP_ERR_INVALID_STATE error if the queue for outgoing messages of the application is full.
      *
      * @return
      *              - ESP_OK if sent was success
      *              - ESP_ERR_INVALID_ARG if parameter error
-     *              - ESP_ERR_INVALID_STATE if queue for outgoing data is almost full
+     *              - ESP_ERR_INVALID_STATE if queue for outgoing data is full
      *              - ESP_FAIL if ESP-NOW is not initialized or any internal error
      */
     esp_err_t zh_network_send(const uint8_t *target, const uint8_t *data, const uint8_t data_len);
 
+    /**
+     * @brief Send ESP-NOW data with the selected delivery mode.
+     *
+     * @param[in] target Pointer to a buffer containing an eight-byte target MAC. Can be NULL for broadcast.
+     * @param[in] data Pointer to a buffer containing the data for send.
+     * @param[in] data_len Sending data length.
+     * @param[in] delivery_mode Delivery mode of the unicast message.
+     * @param[out] message_id Pointer to a variable for the ID of the message. Can be NULL.
+     *
+     * @note zh_network_send() is the same as this function with ZH_NETWORK_DELIVERY_CONFIRMED. The delivery mode is ignored for broadcast and multicast messages.
+     * @note The message ID is returned in the ZH_NETWORK_ON_SEND_EVENT event for this message.
+     *
+     * @return
+     *              - ESP_OK if sent was success
+     *              - ESP_ERR_INVALID_ARG if parameter error
+     *              - ESP_ERR_INVALID_STATE if queue for outgoing data is full
+     *              - ESP_FAIL if ESP-NOW is not initialized or any internal error
+     */
+    esp_err_t zh_network_send_ex(const uint8_t *target, const uint8_t *data, const uint8_t data_len, const zh_network_delivery_mode_t delivery_mode, uint32_t *message_id);
+
+    /**
+     * @brief Send ESP-NOW data and wait for free space in the queue for outgoing messages of the application.
+     *
+     * @param[in] target Pointer to a buffer containing an eight-byte target MAC. Can be NULL for broadcast.
+     * @param[in] data Pointer to a buffer containing the data for send.
+     * @param[in] data_len Sending data length.
+     * @param[in] timeout Maximum time to wait for free space in the queue (in milliseconds).
+     *
+     * @attention Must not be called from the functions registered by zh_network_register_recv_cb() and zh_network_register_send_cb().
+     *
+     * @return
+     *              - ESP_OK if sent was success
+     *              - ESP_ERR_INVALID_ARG if parameter error
+     *              - ESP_ERR_TIMEOUT if the queue for outgoing data stayed full during the timeout
+     *              - ESP_FAIL if ESP-NOW is not initialized or any internal error
+     */
+    esp_err_t zh_network_send_blocking(const uint8_t *target, const uint8_t *data, const uint8_t data_len, const uint32_t timeout);
+
+    /**
+     * @brief Send ESP-NOW data larger than ZH_NETWORK_MAX_MESSAGE_SIZE.
+     *
+     * @param[in] target Pointer to a buffer containing an eight-byte target MAC. Broadcast is not supported.
+     * @param[in] data Pointer to a buffer containing the data for send.
+     * @param[in] data_len Sending data length. The maximum value is 32 * (ZH_NETWORK_MAX_MESSAGE_SIZE - 9) bytes.
+     *
+     * @note The data is sent in fragments with one delivery confirmation for all fragments. Missing fragments are repeated. Data up to ZH_NETWORK_MAX_MESSAGE_SIZE is sent by zh_network_send().
+     *
+     * @return
+     *              - ESP_OK if sent was success
+     *              - ESP_ERR_INVALID_ARG if parameter error
+     *              - ESP_ERR_INVALID_STATE if the list of fragmented messages is full
+     *              - ESP_FAIL if ESP-NOW is not initialized or any internal error
+     */
+    esp_err_t zh_network_send_large(const uint8_t *target, const uint8_t *data, const uint16_t data_len);
+
+    /**
+     * @brief Send ESP-NOW data to all members of a group.
+     *
+     * @param[in] group_id ID of the group.
+     * @param[in] data Pointer to a buffer containing the data for send.
+     * @param[in] data_len Sending data length.
+     *
+     * @note The message is resent to all nodes like a broadcast message, but only the members of the group receive it. The sender does not receive its own message.
+     *
+     * @return
+     *              - ESP_OK if sent was success
+     *              - ESP_ERR_INVALID_ARG if parameter error
+     *              - ESP_ERR_INVALID_STATE if queue for outgoing data is full
+     *              - ESP_FAIL if ESP-NOW is not initialized or any internal error
+     */
+    esp_err_t zh_network_send_group(const uint16_t group_id, const uint8_t *data, const uint8_t data_len);
+
+    /**
+     * @brief Join a group for receiving multicast messages.
+     *
+     * @param[in] group_id ID of the group.
+     *
+     * @return
+     *              - ESP_OK if joining was success or the device is already a member of the group
+     *              - ESP_ERR_NO_MEM if the group table is full
+     *              - ESP_FAIL if ESP-NOW is not initialized
+     */
+    esp_err_t zh_network_join_group(const uint16_t group_id);
+
+    /**
+     * @brief Leave a group.
+     *
+     * @param[in] group_id ID of the group.
+     *
+     * @return
+     *              - ESP_OK if leaving was success
+     *              - ESP_ERR_NOT_FOUND if the device is not a member of the group
+     *              - ESP_FAIL if ESP-NOW is not initialized
+     */
+    esp_err_t zh_network_leave_group(const uint16_t group_id);
+
+    /**
+     * @brief Register a function for receiving ESP-NOW messages.
+     *
+     * @param[in] cb Function for receiving ESP-NOW messages. Can be NULL for return to the ZH_NETWORK_ON_RECV_EVENT event.
+     *
+     * @note While the function is registered, received messages are passed to it directly and the ZH_NETWORK_ON_RECV_EVENT event is not posted. The function must not block the ESP-NOW messages processing task.
+     *
+     * @return
+     *              - ESP_OK if registration was success
+     *              - ESP_FAIL if ESP-NOW is not initialized
+     */
+    esp_err_t zh_network_register_recv_cb(zh_network_recv_cb_t cb);
+
+    /**
+     * @brief Register a function for receiving the sending status of ESP-NOW messages.
+     *
+     * @param[in] cb Pointer to the function. NULL to use the ZH_NETWORK_ON_SEND_EVENT event again.
+     * @param[in] arg Pointer to the user data for the function. Can be NULL.
+     *
+     * @note While the function is registered, the ZH_NETWORK_ON_SEND_EVENT event is not posted.
+     *
+     * @return
+     *              - ESP_OK if registration was success
+     *              - ESP_FAIL if ESP-NOW is not initialized
+     */
+    esp_err_t zh_network_register_send_cb(zh_network_send_cb_t cb, void *arg);
+
+    /**
+     * @brief Free the data of the received ESP-NOW message.
+     *
+     * @param[in] data Pointer to the data from zh_network_event_on_recv_t structure.
+     *
+     * @note The data is returned to the preallocated buffers or freed in the heap.
+     *
+     * @return
+     *              - ESP_OK if free was success
+     *              - ESP_ERR_INVALID_ARG if parameter error
+     */
+    esp_err_t zh_network_free_data(uint8_t *data);
+
+    /**
+     * @brief Get the number of received messages for which there was no free preallocated buffer.
+     *
+     * @note Can be used to select the data_pool_size value. The same value is available in zh_network_stats_t structure.
+     *
+     * @return Number of received messages whose data was allocated in the heap because of no free preallocated buffer.
+     */
+    uint32_t zh_network_get_data_pool_exhausted(void);
+
+    /**
+     * @brief Print the binary trace of ESP-NOW messages processing.
+     *
+     * @note The trace is enabled by CONFIG_ZH_NETWORK_TRACE in menuconfig. Records are printed from the oldest to the newest.
+     *
+     * @return
+     *              - ESP_OK if dump was success
+     *              - ESP_ERR_NOT_SUPPORTED if the trace is disabled
+     *              - ESP_FAIL if any internal error
+     */
+    esp_err_t zh_network_dump_trace(void);
+
+    /**
+     * @brief Get ESP-NOW statistics.
+     *
+     * @param[out] stats Pointer to a structure for the statistics.
+     *
+     * @return
+     *              - ESP_OK if reading was success
+     *              - ESP_ERR_INVALID_ARG if parameter error
+     *              - ESP_FAIL if ESP-NOW is not initialized
+     */
+    esp_err_t zh_network_get_stats(zh_network_stats_t *stats);
+
+    /**
+     * @brief Get latency histograms of messages processing.
+     *
+     * @param[out] latency Pointer to a structure for the histograms.
+     *
+     * @note Requires CONFIG_ZH_NETWORK_LATENCY. The histograms are reset by zh_network_reset_stats().
+     *
+     * @return
+     *              - ESP_OK if reading was success
+     *              - ESP_ERR_INVALID_ARG if parameter error
+     *              - ESP_ERR_NOT_SUPPORTED if the latency histograms are disabled
+     *              - ESP_FAIL if ESP-NOW is not initialized
+     */
+    esp_err_t zh_network_get_latency(zh_network_latency_t *latency);
+
+    /**
+     * @brief Reset ESP-NOW statistics.
+     *
+     * @return
+     *              - ESP_OK if reset was success
+     *              - ESP_FAIL if ESP-NOW is not initialized
+     */
+    esp_err_t zh_network_reset_stats(void);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "zh_network.h"
+
+// Runs every node of the network in its own process. Node 0 sends confirmed unicast messages to the last node of the line and one broadcast message.
+// The run fails if a message gets no send status or more than one, if a message is delivered to the application twice, or if a message is lost without frame loss.
+
+#define SIM_PORT 47000         // UDP port of the first node.
+#define SIM_START_DELAY 200    // Time for starting all nodes before sending (in milliseconds).
+#define SIM_RESULT_TIMEOUT 30  // Maximum time to wait the send status of all messages (in seconds).
+#define SIM_SETTLE_TIME 2      // Time to wait for late send statuses and deliveries after the last status (in seconds).
+#define SIM_MAX_MESSAGES 10000 // Maximum number of sent messages.
+#define SIM_MAX_OUTSTANDING 16 // Maximum number of sent messages waiting for the send status. Must be less than the size of the waiting list.
+
+static uint8_t _node_count = 4;
+static uint16_t _message_count = 100;
+static uint8_t _loss = 0;
+static volatile uint32_t _send_success_count = 0;
+static volatile uint32_t _send_fail_count = 0;
+static volatile uint32_t _recv_count = 0;
+static volatile uint32_t _recv_duplicate_count = 0;
+static volatile bool _is_broadcast_received = false;
+static volatile sig_atomic_t _is_terminated = 0;
+static uint8_t _is_delivered[SIM_MAX_MESSAGES] = {0};
+
+static void _send_cb(const zh_network_event_on_send_t *on_send, void *arg)
+{
+    if (on_send->status == ZH_NETWORK_SEND_SUCCESS)
+    {
+        ++_send_success_count;
+    }
+    else
+    {
+        ++_send_fail_count;
+    }
+}
+
+static void _recv_cb(const uint8_t *mac_addr, const uint8_t *data, const uint16_t data_len)
+{
+    uint16_t sequence = 0;
+    if (data_len == 1)
+    {
+        _is_broadcast_received = true;
+        return;
+    }
+    if (data_len != sizeof(sequence))
+    {
+        return;
+    }
+    memcpy(&sequence, data, sizeof(sequence));
+    if (sequence >= SIM_MAX_MESSAGES)
+    {
+        return;
+    }
+    if (_is_delivered[sequence] != 0)
+    {
+        ++_recv_duplicate_count;
+        return;
+    }
+    _is_delivered[sequence] = 1;
+    ++_recv_count;
+}
+
+static int _sender_run(void)
+{
+    uint8_t target[6] = {0};
+    sim_get_mac(_node_count - 1, target);
+    vTaskDelay(SIM_START_DELAY / portTICK_PERIOD_MS);
+    int64_t time = esp_timer_get_time();
+    for (uint16_t i = 0; i < _message_count;)
+    {
+        if (i - (_send_success_count + _send_fail_count) >= SIM_MAX_OUTSTANDING)
+        {
+            vTaskDelay(1);
+            continue;
+        }
+        if (zh_network_send_ex(target, (uint8_t *)&i, sizeof(i), ZH_NETWORK_DELIVERY_CONFIRMED, NULL) == ESP_OK)
+        {
+            ++i;
+            continue;
+        }
+        vTaskDelay(1); // The queue is full.
+    }
+    uint8_t broadcast = 0;
+    zh_network_send(NULL, &broadcast, sizeof(broadcast));
+    while (_send_success_count + _send_fail_count < _message_count + 1U && esp_timer_get_time() - time < SIM_RESULT_TIMEOUT * 1000000LL)
+    {
+        vTaskDelay(10);
+    }
+    time = esp_timer_get_time() - time;
+    vTaskDelay(SIM_SETTLE_TIME * 1000 / portTICK_PERIOD_MS);
+    zh_network_stats_t stats = {0};
+    zh_network_get_stats(&stats);
+    printf("Node 0: %u messages, %" PRIu32 " success, %" PRIu32 " fail in %lld ms. Retries %" PRIu32 ", duplicates dropped %" PRIu32 ".\n",
+           _message_count + 1U, _send_success_count, _send_fail_count, (long long)(time / 1000), stats.send_retries, stats.duplicates_dropped);
+    if (_send_success_count + _send_fail_count != _message_count + 1U)
+    {
+        printf("Node 0: FAIL. Not every message got exactly one send status.\n");
+        return EXIT_FAILURE;
+    }
+    if (_loss == 0 && _send_fail_count != 0)
+    {
+        printf("Node 0: FAIL. Messages were lost without frame loss.\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int _node_run(const uint8_t index)
+{
+    sim_config_t sim_config = {.index = index, .node_count = _node_count, .loss = _loss, .port = SIM_PORT, .log_level = ESP_LOG_WARN};
+    if (getenv("SIM_LOG_LEVEL") != NULL)
+    {
+        sim_config.log_level = atoi(getenv("SIM_LOG_LEVEL"));
+    }
+    sim_start(&sim_config);
+    zh_network_init_config_t config = ZH_NETWORK_INIT_CONFIG_DEFAULT();
+    if (zh_network_init(&config) != ESP_OK)
+    {
+        return EXIT_FAILURE;
+    }
+    zh_network_register_recv_cb(_recv_cb);
+    zh_network_register_send_cb(_send_cb, NULL);
+    if (index == 0)
+    {
+        return _sender_run();
+    }
+    while (_is_terminated == 0)
+    {
+        vTaskDelay(10); // The launcher stops the other nodes after node 0.
+    }
+    if (index != _node_count - 1)
+    {
+        return EXIT_SUCCESS;
+    }
+    printf("Node %u: %" PRIu32 " messages delivered, %" PRIu32 " delivered twice, broadcast %s.\n",
+           index, _recv_count, _recv_duplicate_count, (_is_broadcast_received == true) ? "received" : "lost");
+    if (_recv_duplicate_count != 0)
+    {
+        printf("Node %u: FAIL. Messages were delivered to the application twice.\n", index);
+        return EXIT_FAILURE;
+    }
+    if (_loss == 0 && (_recv_count != _message_count || _is_broadcast_received == false))
+    {
+        printf("Node %u: FAIL. Messages were lost without frame loss.\n", index);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void _on_terminate(int signal)
+{
+    _is_terminated = 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        _node_count = atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        _message_count = atoi(argv[2]);
+    }
+    if (argc > 3)
+    {
+        _loss = atoi(argv[3]);
+    }
+    if (argc > 4 || _node_count < 2 || _node_count > ESP_NOW_MAX_TOTAL_PEER_NUM || _message_count == 0 || _message_count > SIM_MAX_MESSAGES || _loss > 100)
+    {
+        printf("Usage: %s [nodes (2-%d), default 4] [messages (1-%d), default 100] [frame loss in percent, default 0]\n", argv[0], ESP_NOW_MAX_TOTAL_PEER_NUM, SIM_MAX_MESSAGES);
+        return EXIT_FAILURE;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    pid_t pid[ESP_NOW_MAX_TOTAL_PEER_NUM] = {0};
+    for (uint8_t i = 0; i < _node_count; ++i)
+    {
+        pid[i] = fork();
+        if (pid[i] == 0)
+        {
+            signal(SIGTERM, _on_terminate);
+            _exit(_node_run(i));
+        }
+    }
+    int status = 0;
+    int result = EXIT_SUCCESS;
+    waitpid(pid[0], &status, 0);
+    if (WIFEXITED(status) == false || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        result = EXIT_FAILURE;
+    }
+    for (uint8_t i = 1; i < _node_count; ++i)
+    {
+        kill(pid[i], SIGTERM);
+        waitpid(pid[i], &status, 0);
+        if (WIFEXITED(status) == false || WEXITSTATUS(status) != EXIT_SUCCESS)
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+    printf("%s\n", (result == EXIT_SUCCESS) ? "PASS" : "FAIL");
+    return result;
+}
@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include "sim.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define SIM_DRIVER_BUFFER 8 // Number of frames the simulated driver accepts before esp_now_send() returns ESP_ERR_ESPNOW_NO_MEM.
+#define SIM_AIRTIME 500     // Time of sending one frame (in microseconds).
+
+struct sim_queue
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t *buffer;
+};
+
+struct sim_task
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t notify;
+    TaskFunction_t function;
+    void *arg;
+};
+
+typedef struct
+{
+    uint8_t peer_addr[6];
+    uint16_t len;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN + 1]; // The first byte is the index of the sender.
+} sim_frame_t;
+
+static sim_config_t _config = {0};
+static pthread_mutex_t _critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static __thread struct sim_task *_current_task = NULL;
+static int _socket = -1;
+static QueueHandle_t _driver_queue = NULL;
+static esp_now_recv_cb_t _recv_cb = NULL;
+static esp_now_send_cb_t _send_cb = NULL;
+static uint8_t _peers[ESP_NOW_MAX_TOTAL_PEER_NUM][6] = {0};
+static bool _is_peer_used[ESP_NOW_MAX_TOTAL_PEER_NUM] = {0};
+static const uint8_t _broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+static void _get_deadline(struct timespec *deadline, const TickType_t ticks)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ticks / 1000;
+    deadline->tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static void _cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static bool _cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline, const TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        pthread_cond_wait(cond, mutex);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, mutex, deadline) != ETIMEDOUT;
+}
+
+void sim_enter_critical(void)
+{
+    pthread_mutex_lock(&_critical);
+}
+
+void sim_exit_critical(void)
+{
+    pthread_mutex_unlock(&_critical);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct sim_queue *queue = calloc(1, sizeof(struct sim_queue));
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+    queue->buffer = calloc(length, item_size);
+    if (queue->buffer == NULL)
+    {
+        free(queue);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->mutex, NULL);
+    _cond_init(&queue->cond);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    if (queue == NULL)
+    {
+        return;
+    }
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->cond);
+    free(queue->buffer);
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    struct timespec deadline = {0};
+    _get_deadline(&deadline, ticks);
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->length)
+    {
+        if (ticks == 0 || _cond_wait(&queue->cond, &queue->mutex, &deadline, ticks) == false)
+        {
+            pthread_mutex_unlock(&queue->mutex);
+            return pdFALSE;
+        }
+    }
+    memcpy(&queue->buffer[((queue->head + queue->count) % queue->length) * queue->item_size], item, queue->item_size);
+    ++queue->count;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    struct timespec deadline = {0};
+    _get_deadline(&deadline, ticks);
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0)
+    {
+        if (ticks == 0 || _cond_wait(&queue->cond, &queue->mutex, &deadline, ticks) == false)
+        {
+            pthread_mutex_unlock(&queue->mutex);
+            return pdFALSE;
+        }
+    }
+    memcpy(item, &queue->buffer[queue->head * queue->item_size], queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    --queue->count;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    UBaseType_t spaces = queue->length - queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return spaces;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+static void *_task_main(void *arg)
+{
+    _current_task = arg;
+    _current_task->function(_current_task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, TaskHandle_t *task, BaseType_t core_id)
+{
+    struct sim_task *item = calloc(1, sizeof(struct sim_task));
+    if (item == NULL)
+    {
+        return pdFALSE;
+    }
+    pthread_mutex_init(&item->mutex, NULL);
+    _cond_init(&item->cond);
+    item->function = function;
+    item->arg = arg;
+    if (task != NULL)
+    {
+        *task = item;
+    }
+    if (pthread_create(&item->thread, NULL, _task_main, item) != 0)
+    {
+        free(item);
+        return pdFALSE;
+    }
+    pthread_detach(item->thread);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL || task == _current_task)
+    {
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep((useconds_t)ticks * portTICK_PERIOD_MS * 1000);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->mutex);
+    ++task->notify;
+    pthread_cond_broadcast(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t is_clear, TickType_t ticks)
+{
+    struct sim_task *task = _current_task;
+    struct timespec deadline = {0};
+    _get_deadline(&deadline, ticks);
+    pthread_mutex_lock(&task->mutex);
+    while (task->notify == 0 && ticks != 0 && _cond_wait(&task->cond, &task->mutex, &deadline, ticks) == true)
+    {
+    }
+    uint32_t notify = task->notify;
+    if (notify != 0)
+    {
+        task->notify = (is_clear == pdTRUE) ? 0 : notify - 1;
+    }
+    pthread_mutex_unlock(&task->mutex);
+    return notify;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec time = {0};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+uint32_t esp_random(void)
+{
+    static __thread unsigned int seed = 0;
+    if (seed == 0)
+    {
+        seed = (unsigned int)(getpid() ^ esp_timer_get_time() ^ (intptr_t)&seed);
+    }
+    return ((uint32_t)rand_r(&seed) << 16) ^ (uint32_t)rand_r(&seed);
+}
+
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_channel(uint8_t *primary, wifi_second_chan_t *second)
+{
+    *primary = 1;
+    *second = WIFI_SECOND_CHAN_NONE;
+    return ESP_OK;
+}
+
+void sim_get_mac(const uint8_t index, uint8_t *mac)
+{
+    const uint8_t node_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, index + 1};
+    memcpy(mac, node_mac, 6);
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type)
+{
+    sim_get_mac(_config.index, mac);
+    return ESP_OK;
+}
+
+static bool _is_neighbour(const uint8_t index)
+{
+    return index < _config.node_count && (index + 1 == _config.index || index == _config.index + 1);
+}
+
+static bool _transmit(const uint8_t index, const uint8_t *data, const uint16_t len)
+{
+    if (_is_neighbour(index) == false || esp_random() % 100 < _config.loss)
+    {
+        return false;
+    }
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(_config.port + index), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    return sendto(_socket, data, len, 0, (struct sockaddr *)&addr, sizeof(addr)) == len;
+}
+
+static void *_driver_main(void *arg)
+{
+    sim_frame_t frame = {0};
+    for (;;)
+    {
+        xQueueReceive(_driver_queue, &frame, portMAX_DELAY);
+        usleep(SIM_AIRTIME);
+        esp_now_send_status_t status = ESP_NOW_SEND_SUCCESS;
+        if (memcmp(frame.peer_addr, _broadcast_mac, 6) == 0)
+        {
+            if (_config.index != 0)
+            {
+                _transmit(_config.index - 1, frame.data, frame.len);
+            }
+            _transmit(_config.index + 1, frame.data, frame.len);
+        }
+        else if (_transmit(frame.peer_addr[5] - 1, frame.data, frame.len) == false)
+        {
+            status = ESP_NOW_SEND_FAIL;
+        }
+        esp_now_send_cb_t send_cb = _send_cb;
+        if (send_cb != NULL)
+        {
+            send_cb(frame.peer_addr, status);
+        }
+    }
+    return NULL;
+}
+
+static void *_recv_main(void *arg)
+{
+    uint8_t data[ESP_NOW_MAX_DATA_LEN + 1] = {0};
+    uint8_t self_mac[6] = {0};
+    sim_get_mac(_config.index, self_mac);
+    for (;;)
+    {
+        ssize_t len = recv(_socket, data, sizeof(data), 0);
+        esp_now_recv_cb_t recv_cb = _recv_cb;
+        if (len < 1 || recv_cb == NULL)
+        {
+            continue;
+        }
+        uint8_t src_mac[6] = {0};
+        sim_get_mac(data[0], src_mac);
+        wifi_pkt_rx_ctrl_t rx_ctrl = {.rssi = -50};
+        esp_now_recv_info_t info = {.src_addr = src_mac, .des_addr = self_mac, .rx_ctrl = &rx_ctrl};
+        recv_cb(&info, &data[1], (int)len - 1);
+    }
+    return NULL;
+}
+
+void sim_start(const sim_config_t *config)
+{
+    _config = *config;
+    _socket = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(_config.port + _config.index), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (_socket < 0 || bind(_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("Simulated radio initialization fail");
+        exit(EXIT_FAILURE);
+    }
+    _driver_queue = xQueueCreate(SIM_DRIVER_BUFFER, sizeof(sim_frame_t));
+    pthread_t thread;
+    pthread_create(&thread, NULL, _driver_main, NULL);
+    pthread_detach(thread);
+    pthread_create(&thread, NULL, _recv_main, NULL);
+    pthread_detach(thread);
+}
+
+esp_err_t esp_now_init(void)
+{
+    return (_socket < 0) ? ESP_ERR_WIFI_NOT_INIT : ESP_OK;
+}
+
+esp_err_t esp_now_deinit(void)
+{
+    _recv_cb = NULL;
+    _send_cb = NULL;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb)
+{
+    _recv_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_unregister_recv_cb(void)
+{
+    _recv_cb = NULL;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb)
+{
+    _send_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_unregister_send_cb(void)
+{
+    _send_cb = NULL;
+    return ESP_OK;
+}
+
+static int _peer_find(const uint8_t *peer_addr)
+{
+    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; ++i)
+    {
+        if (_is_peer_used[i] == true && memcmp(_peers[i], peer_addr, 6) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer)
+{
+    if (_peer_find(peer->peer_addr) >= 0)
+    {
+        return ESP_ERR_ESPNOW_EXIST;
+    }
+    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; ++i)
+    {
+        if (_is_peer_used[i] == false)
+        {
+            memcpy(_peers[i], peer->peer_addr, 6);
+            _is_peer_used[i] = true;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_FULL;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr)
+{
+    int i = _peer_find(peer_addr);
+    if (i < 0)
+    {
+        return ESP_ERR_ESPNOW_NOT_FOUND;
+    }
+    _is_peer_used[i] = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len)
+{
+    if (len == 0 || len > ESP_NOW_MAX_DATA_LEN)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (_peer_find(peer_addr) < 0)
+    {
+        return ESP_ERR_ESPNOW_NOT_FOUND;
+    }
+    sim_frame_t frame = {0};
+    memcpy(frame.peer_addr, peer_addr, 6);
+    frame.len = len + 1;
+    frame.data[0] = _config.index;
+    memcpy(&frame.data[1], data, len);
+    return (xQueueSend(_driver_queue, &frame, 0) == pdTRUE) ? ESP_OK : ESP_ERR_ESPNOW_NO_MEM;
+}
+
+esp_err_t esp_event_post(esp_event_base_t base, int32_t id, const void *data, size_t size, TickType_t ticks)
+{
+    return ESP_OK; // The simulator uses the callbacks registered by zh_network_register_recv_cb() and zh_network_register_send_cb().
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length)
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t count, size_t size, uint32_t caps)
+{
+    return calloc(count, size);
+}
+
+void heap_caps_free(void *ptr)
+{
+    free(ptr);
+}
+
+void sim_log(const esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    if (level > _config.log_level)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    flockfile(stdout);
+    printf("%c (%lld) node %d %s: ", "NEWI"[level], (long long)(esp_timer_get_time() / 1000), _config.index, tag);
+    vprintf(format, args);
+    printf("\n");
+    funlockfile(stdout);
+    fflush(stdout);
+    va_end(args);
+}
@@ -1,37 +1,143 @@
 #include "zh_network.h"
 
-#define DATA_SEND_SUCCESS BIT0
-#define DATA_SEND_FAIL BIT1
-#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
-
-static void _send_cb(const uint8_t *mac_addr, esp_now_send_status_t status);
-#if defined CONFIG_IDF_TARGET_ESP8266 || ESP_IDF_VERSION_MAJOR == 4
-static void _recv_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+#define MAX_SEND_RESULT_WAITING_TIME 50
+#define SEND_DEFER_TIME 2 // Time before sending again a frame not accepted because the ESP-NOW driver buffer is full (in milliseconds).
+#define HASH_PROBE_LIMIT 8
+#define ID_WINDOW_SIZE 32
+#define RESTART_IDLE_TIME 1000 // Minimum time without messages from a node (in milliseconds) after which a message ID behind the window is treated as a restart of the node.
+#define MAX_FRAGMENT_COUNT 32
+#ifdef CONFIG_ZH_NETWORK_ESPNOW_V2
+#ifndef ESP_NOW_MAX_DATA_LEN_V2
+#error "ESP-NOW v2 frames require ESP-IDF v5.4 or later."
+#endif
+#define MAX_FRAME_SIZE ESP_NOW_MAX_DATA_LEN_V2
 #else
-static void _recv_cb(const esp_now_recv_info_t *esp_now_info, const uint8_t *data, int data_len);
+#define MAX_FRAME_SIZE ESP_NOW_MAX_DATA_LEN
 #endif
-static void _processing(void *pvParameter);
+#ifdef CONFIG_IDF_TARGET_ESP8266
+#define ENTER_CRITICAL() portENTER_CRITICAL()
+#define EXIT_CRITICAL() portEXIT_CRITICAL()
+#else
+#define ENTER_CRITICAL() portENTER_CRITICAL(&_spinlock)
+#define EXIT_CRITICAL() portEXIT_CRITICAL(&_spinlock)
+#endif
+#ifdef CONFIG_ZH_NETWORK_DISABLE_HOT_PATH_LOG
+#define HOT_LOGI(...)
+#define HOT_LOGW(...)
+#else
+#define HOT_LOGI(...) ESP_LOGI(__VA_ARGS__)
+#define HOT_LOGW(...) ESP_LOGW(__VA_ARGS__)
+#endif
+#ifdef CONFIG_ZH_NETWORK_TRACE
+#define TRACE(event, message) _trace_add(event, message)
+#else
+#define TRACE(event, message)
+#endif
+#ifdef CONFIG_ZH_NETWORK_LATENCY
+#define LATENCY_STAMP(queue) ((queue)->stamp = esp_timer_get_time())
+#define LATENCY_ADD(stage, queue) _latency_add(stage, queue)
+#else
+#define LATENCY_STAMP(queue)
+#define LATENCY_ADD(stage, queue)
+#endif
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+#define MESSAGE_HEADER_SIZE (sizeof(_message_t) - ZH_NETWORK_MAX_MESSAGE_SIZE)
+#define COMPACT_HEADER_SIZE (sizeof(_compact_message_t) - ZH_NETWORK_MAX_MESSAGE_SIZE)
+#define COMPACT_FLAG 0x80
+#define COMPACT_BROADCAST_FLAG 0x40
+#define FRAGMENT_DATA_SIZE (ZH_NETWORK_MAX_MESSAGE_SIZE - sizeof(_fragment_header_t))
+#define FRAGMENT_MASK(count) (((count) >= 32) ? UINT32_MAX : ((1UL << (count)) - 1))
+#define LINK_RSSI_GOOD -70
+#define LINK_RSSI_STEP 5
+#define LINK_SMOOTHING 4
+#define ROUTE_SNAPSHOT_NAMESPACE "zh_network"
+#define ROUTE_SNAPSHOT_KEY "routes"
 
-static const char *TAG = "zh_network";
+typedef struct
+{
+    bool is_used;
+    uint8_t original_target_mac[6];
+    uint8_t intermediate_target_mac[6];
+    uint8_t hop_count;
+    bool is_verified;
+    uint16_t path_cost;
+    uint32_t message_id;
+    uint64_t time;
+} _routing_table_t;
 
-static EventGroupHandle_t _event_group_handle = {0};
-static QueueHandle_t _queue_handle = {0};
-static TaskHandle_t _processing_task_handle = {0};
-static SemaphoreHandle_t _id_vector_mutex = {0};
-static zh_network_init_config_t _init_config = {0};
-static zh_vector_t _id_vector = {0};
-static zh_vector_t _route_vector = {0};
-static zh_vector_t _response_vector = {0};
-static uint8_t _self_mac[6] = {0};
-static const uint8_t _broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-static bool _is_initialized = false;
-static uint8_t _attempts = 0;
+typedef struct
+{
+    bool is_used;
+    int8_t rssi;
+    uint8_t delivery;
+    uint16_t max_frame;
+    uint64_t time;
+    uint8_t mac_addr[6];
+} _link_t;
 
 typedef struct
 {
     uint8_t original_target_mac[6];
     uint8_t intermediate_target_mac[6];
-} _routing_table_t;
+    uint8_t hop_count;
+    uint32_t message_id;
+} __attribute__((packed)) _route_snapshot_t;
+
+typedef struct
+{
+    enum
+    {
+        BROADCAST,
+        UNICAST,
+        DELIVERY_CONFIRM,
+        SEARCH_REQUEST,
+        SEARCH_RESPONSE,
+        FRAGMENT,
+        FRAGMENT_CONFIRM,
+        AGGREGATE,
+        MULTICAST
+    } __attribute__((packed)) message_type;
+    uint32_t network_id;
+    uint32_t message_id;
+    uint8_t original_target_mac[6];
+    uint8_t original_sender_mac[6];
+    uint8_t sender_mac[6];
+    uint8_t hop_count;
+    uint8_t delivery_mode;
+    uint8_t payload_len;
+    uint8_t payload[ZH_NETWORK_MAX_MESSAGE_SIZE];
+} __attribute__((packed)) _message_t;
+
+typedef struct // Header for messages sent by the original sender directly to the original target. The addresses are restored from the ESP-NOW frame.
+{
+    uint8_t message_type; // Message type with COMPACT_FLAG and COMPACT_BROADCAST_FLAG for broadcast target.
+    uint32_t network_id;
+    uint32_t message_id;
+    uint8_t delivery_mode;
+    uint8_t payload_len;
+    uint8_t payload[ZH_NETWORK_MAX_MESSAGE_SIZE];
+} __attribute__((packed)) _compact_message_t;
+
+typedef struct
+{
+    uint32_t transfer_id;
+    uint16_t data_len;
+    uint8_t index;
+    uint8_t count;
+    bool is_last;
+} __attribute__((packed)) _fragment_header_t;
+
+typedef struct
+{
+    uint32_t transfer_id;
+    uint32_t received;
+} __attribute__((packed)) _fragment_confirm_t;
+
+typedef struct
+{
+    uint32_t message_id;
+    uint32_t window;
+} __attribute__((packed)) _delivery_confirm_t;
 
 typedef struct
 {
@@ -42,28 +148,316 @@ typedef struct
         ON_RECV,
         WAIT_ROUTE,
         WAIT_RESPONSE,
+        WAIT_FLOOD,
     } id;
-    struct
-    {
-        enum
-        {
-            BROADCAST,
-            UNICAST,
-            DELIVERY_CONFIRM,
-            SEARCH_REQUEST,
-            SEARCH_RESPONSE
-        } __attribute__((packed)) message_type;
-        uint32_t network_id;
-        uint32_t message_id;
-        uint32_t confirm_id;
-        uint8_t original_target_mac[6];
-        uint8_t original_sender_mac[6];
-        uint8_t sender_mac[6];
-        uint8_t payload[ZH_NETWORK_MAX_MESSAGE_SIZE];
-        uint8_t payload_len;
-    } __attribute__((packed)) data;
+    int8_t rssi;
+    bool is_repeat;
+    bool is_numbered; // The message was sent at least once. Messages sent again keep the message ID.
+    uint32_t send_id; // ID returned to the application. Differs from the message ID if the message was numbered again before sending.
+#ifdef CONFIG_ZH_NETWORK_LATENCY
+    int64_t stamp; // Time of adding to the queue or of the last sending (in microseconds).
+#endif
+    _message_t data;
 } _queue_t;
 
+typedef struct
+{
+    bool is_used;
+    uint64_t deadline;
+    _queue_t queue;
+} _pending_t;
+
+typedef struct
+{
+    bool is_used;
+    bool is_deferred; // The frame was not accepted by the ESP-NOW driver because of no free buffer and is waiting for sending.
+    uint8_t attempts;
+    uint32_t sequence;
+    uint64_t time;
+    uint8_t peer_addr[6];
+    uint16_t frame_len;
+    uint8_t *frame; // Frame longer than ESP_NOW_MAX_DATA_LEN. Used if frame_len is not 0.
+    _queue_t queue;
+} _inflight_t;
+
+typedef struct
+{
+    uint8_t mac_addr[6];
+    esp_now_send_status_t status;
+} _send_result_t;
+
+typedef struct
+{
+    bool is_used;
+    uint64_t time;
+    uint8_t mac_addr[6];
+} _peer_t;
+
+typedef struct
+{
+    bool is_used;
+    uint64_t time;
+    uint8_t mac_addr[6];
+    uint32_t message_id;
+    uint32_t window;
+    uint32_t copies_message_id;
+    uint8_t copies;
+} _id_cache_t;
+
+typedef struct
+{
+    bool is_used;
+    uint8_t attempts;
+    uint64_t deadline;
+    uint8_t mac_addr[6];
+} _discovery_t;
+
+typedef struct
+{
+    enum
+    {
+        FRAGMENT_FREE,
+        FRAGMENT_RESERVED,
+        FRAGMENT_SENDING,
+        FRAGMENT_WAITING
+    } state;
+    uint8_t attempts;
+    uint8_t index;
+    uint8_t count;
+    uint16_t data_len;
+    uint32_t transfer_id;
+    uint32_t confirmed;
+    uint64_t deadline;
+    uint8_t target_mac[6];
+    uint8_t *data;
+} _fragment_tx_t;
+
+typedef struct
+{
+    bool is_used;
+    bool is_complete;
+    uint8_t count;
+    uint16_t data_len;
+    uint32_t transfer_id;
+    uint32_t received;
+    uint64_t deadline;
+    uint8_t sender_mac[6];
+    uint8_t *data;
+} _fragment_rx_t;
+
+typedef struct
+{
+    bool is_used;
+    bool is_flushed;
+    uint16_t payload_len;
+    uint16_t payload_size;
+    uint64_t deadline;
+    uint8_t *payload;
+    _queue_t queue;
+} _aggregate_t;
+
+typedef struct
+{
+    bool is_used;
+    uint8_t queued;
+    uint32_t credit;
+    uint64_t time;
+    uint8_t mac_addr[6];
+} _origin_t;
+
+typedef struct
+{
+    bool is_used;
+    bool is_pending;
+    uint64_t time;
+    uint64_t deadline;
+    uint8_t mac_addr[6];
+    uint32_t message_id;
+    uint32_t window;
+} _ack_t;
+
+#ifdef CONFIG_ZH_NETWORK_TRACE
+typedef enum
+{
+    TRACE_RECV,
+    TRACE_DROP_REPEAT,
+    TRACE_DROP_QUEUE,
+    TRACE_DROP_HOPS,
+    TRACE_DELIVER,
+    TRACE_SEND,
+    TRACE_SEND_SUCCESS,
+    TRACE_SEND_FAIL,
+    TRACE_CONFIRM,
+    TRACE_TIMEOUT
+} _trace_event_t;
+
+typedef struct
+{
+    uint32_t time;
+    uint32_t message_id;
+    uint8_t event;
+    uint8_t message_type;
+    uint8_t hop_count;
+    uint8_t original_sender_mac[6];
+    uint8_t original_target_mac[6];
+    uint8_t sender_mac[6];
+} _trace_t;
+#endif
+
+static esp_err_t _send(const uint8_t *target, const uint8_t *data, const uint8_t data_len, const zh_network_delivery_mode_t delivery_mode, uint32_t *message_id, const TickType_t wait_time);
+static void _send_cb(const uint8_t *mac_addr, esp_now_send_status_t status);
+#if defined CONFIG_IDF_TARGET_ESP8266 || ESP_IDF_VERSION_MAJOR == 4
+static void _recv_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+#else
+static void _recv_cb(const esp_now_recv_info_t *esp_now_info, const uint8_t *data, int data_len);
+#endif
+static void _recv_frame(const uint8_t *src_addr, const int8_t rssi, const uint8_t *data, const int data_len, const bool is_inner);
+static void _processing(void *pvParameter);
+static bool _recv_notify(const _queue_t *queue);
+static bool _send_notify(const zh_network_event_on_send_t *on_send);
+static uint8_t *_data_pool_alloc(const uint8_t data_len);
+static void _stats_inc(uint32_t *counter);
+static void _stats_inc_type(uint32_t *counters, const uint8_t message_type);
+static void _stats_high_water(uint32_t *high_water, QueueHandle_t queue_handle, const uint8_t queue_size);
+static bool _pending_add(const _queue_t *queue);
+static void _pending_route_found(const uint8_t *mac_addr);
+static void _pending_resend(_pending_t *pending);
+static void _pending_confirm_received(const _message_t *message);
+static void _pending_confirm(_pending_t *pending);
+static void _pending_check_timeouts(void);
+static uint64_t _pending_get_deadline(void);
+static void _pending_add_fail(const _queue_t *queue);
+static bool _peer_add(const uint8_t *mac_addr);
+static bool _peer_is_in_use(const uint8_t *mac_addr);
+static void _peer_sync(void);
+static _inflight_t *_inflight_get_free(void);
+static void _inflight_send(_inflight_t *inflight);
+static void _inflight_complete(_inflight_t *inflight, const bool is_success);
+static void _send_complete(_queue_t *queue, const uint8_t *peer_addr, const bool is_success);
+static void _inflight_result(const uint8_t *mac_addr, const bool is_success);
+static void _inflight_check_timeouts(void);
+static uint64_t _inflight_get_deadline(void);
+static TickType_t _get_wait_time(void);
+static QueueHandle_t _queue_get_handle(const _queue_t *queue);
+static bool _queue_push(_queue_t *queue);
+static bool _queue_pop(_queue_t *queue, const bool is_recv_first);
+static void _queue_watermark_check(void);
+static uint32_t _get_message_id(void);
+static uint32_t _mac_hash(const uint8_t *mac_addr);
+static bool _id_cache_is_repeat(const uint8_t *mac_addr, const uint32_t message_id);
+static uint8_t _id_cache_get_copies(const uint8_t *mac_addr, const uint32_t message_id);
+static void _flood_forward(_queue_t *queue);
+static void _flood_send(_queue_t *queue);
+static bool _flood_add(const _queue_t *queue);
+static void _flood_check_timeouts(void);
+static uint64_t _flood_get_deadline(void);
+#ifdef CONFIG_ZH_NETWORK_TRACE
+static void _trace_add(const _trace_event_t event, const _message_t *message);
+#endif
+#ifdef CONFIG_ZH_NETWORK_LATENCY
+static void _latency_add(const zh_network_latency_stage_t stage, const _queue_t *queue);
+#endif
+static _routing_table_t *_route_find(const uint8_t *mac_addr);
+static void _route_update(const uint8_t *original_target_mac, const uint8_t *intermediate_target_mac, const uint8_t hop_count, const uint16_t path_cost, const uint32_t message_id);
+static void _route_delete(const uint8_t *mac_addr);
+static void _route_learn(const _message_t *message);
+static void _route_load(void);
+static void _route_save(void);
+static void _route_save_check(void);
+static uint64_t _route_save_get_deadline(void);
+static _link_t *_link_get(const uint8_t *mac_addr);
+static void _link_recv(const uint8_t *mac_addr, const int8_t rssi);
+static void _link_send_result(const uint8_t *mac_addr, const bool is_success);
+static uint8_t _link_get_cost(const uint8_t *mac_addr);
+static uint16_t _link_add_path_cost(_message_t *message);
+static void _link_set_path_cost(_message_t *message, const uint16_t path_cost);
+static void _discovery_start(const uint8_t *mac_addr);
+static void _discovery_send(const uint8_t *mac_addr);
+static void _discovery_stop(const uint8_t *mac_addr);
+static void _discovery_check_timeouts(void);
+static uint64_t _discovery_get_deadline(void);
+static void _fragment_send_next(void);
+static void _fragment_send_result(_fragment_tx_t *fragment_tx, const bool is_success);
+static void _fragment_recv(const _message_t *message);
+static void _fragment_confirm_send(const _fragment_rx_t *fragment_rx);
+static void _fragment_confirm_received(const _message_t *message);
+static void _fragment_check_timeouts(void);
+static uint64_t _fragment_get_deadline(void);
+static bool _aggregate_add(const _queue_t *queue, const uint8_t *peer_addr);
+static void _aggregate_flush(_aggregate_t *aggregate);
+static bool _aggregate_take(const uint8_t *peer_addr, _inflight_t *inflight);
+static void _aggregate_complete(const _queue_t *queue, const uint8_t *peer_addr, const uint8_t *payload, const uint16_t payload_len, const bool is_success);
+static void _aggregate_recv(const uint8_t *src_addr, const int8_t rssi, const uint8_t *payload, const uint16_t payload_len);
+static uint16_t _aggregate_get_payload_size(const uint8_t *peer_addr);
+static void _aggregate_check_timeouts(void);
+static uint64_t _aggregate_get_deadline(void);
+static void _ack_add(const _message_t *message);
+static void _ack_send(_ack_t *ack);
+static void _ack_check_timeouts(void);
+static uint64_t _ack_get_deadline(void);
+static bool _origin_admit(const _message_t *message);
+static void _origin_release(const _message_t *message);
+static void _group_get_mac(const uint16_t group_id, uint8_t *mac_addr);
+static bool _group_is_mac(const uint8_t *mac_addr);
+static bool _group_is_member(const uint8_t *mac_addr);
+static bool _compact_is_allowed(const _message_t *message, const uint8_t *peer_addr);
+static uint16_t _compact_encode(const _message_t *message, uint8_t *frame);
+static uint16_t _compact_decode(const uint8_t *src_addr, const uint8_t *frame, const int frame_len, _message_t *message);
+
+static const char *TAG = "zh_network";
+
+static QueueHandle_t _queue_handle = {0};
+static QueueHandle_t _rx_queue_handle = {0};
+static QueueHandle_t _control_queue_handle = {0};
+static QueueHandle_t _confirm_queue_handle = {0};
+static QueueHandle_t _forward_queue_handle = {0};
+static QueueHandle_t _send_result_queue_handle = {0};
+static TaskHandle_t _processing_task_handle = {0};
+static zh_network_init_config_t _init_config = {0};
+static _id_cache_t *_id_cache = NULL;
+static uint32_t _message_id = 0;
+static uint32_t _sent_message_id = 0;
+static _routing_table_t *_route_table = NULL;
+static _link_t *_link_table = NULL;
+static bool _route_is_changed = false;
+static uint64_t _route_save_time = 0;
+static _discovery_t *_discovery_table = NULL;
+static _pending_t *_pending_table = NULL;
+static _pending_t *_flood_table = NULL;
+static _inflight_t *_inflight_table = NULL;
+static _fragment_tx_t *_fragment_tx_table = NULL;
+static _fragment_rx_t *_fragment_rx_table = NULL;
+static _aggregate_t *_aggregate_table = NULL;
+static _ack_t *_ack_table = NULL;
+static _origin_t *_origin_table = NULL;
+static uint16_t *_group_table = NULL;
+static uint8_t _group_count = 0;
+static uint32_t _inflight_sequence = 0;
+static _peer_t _peer_cache[ESP_NOW_MAX_TOTAL_PEER_NUM] = {0};
+static uint8_t _self_mac[6] = {0};
+static const uint8_t _broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+static const uint8_t _group_mac_prefix[4] = {0x01, 0x00, 0x00, 0x00};
+static zh_network_recv_cb_t _on_recv_cb = NULL;
+static zh_network_send_cb_t _on_send_cb = NULL;
+static void *_on_send_cb_arg = NULL;
+static uint8_t *_data_pool = NULL;
+static uint8_t *_data_pool_free = NULL;
+static uint8_t _data_pool_free_count = 0;
+static zh_network_stats_t _stats = {0};
+static bool _is_queue_high = false;
+static bool _is_initialized = false;
+#ifdef CONFIG_ZH_NETWORK_TRACE
+static _trace_t _trace_ring[CONFIG_ZH_NETWORK_TRACE_SIZE] = {0};
+static uint16_t _trace_head = 0;
+static uint16_t _trace_count = 0;
+#endif
+#ifdef CONFIG_ZH_NETWORK_LATENCY
+static zh_network_latency_t _latency = {0};
+#endif
+#ifndef CONFIG_IDF_TARGET_ESP8266
+static portMUX_TYPE _spinlock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
 ESP_EVENT_DEFINE_BASE(ZH_NETWORK);
 
 esp_err_t zh_network_init(const zh_network_init_config_t *config)
@@ -96,7 +490,39 @@ esp_err_t zh_network_init(const zh_network_init_config_t *config)
             ESP_LOGW(TAG, "ESP-NOW initialization warning. The device is connected to the router. Channel %d will be used for ESP-NOW.", prim);
         }
     }
-    if ((sizeof(_queue_t) - 14) > ESP_NOW_MAX_DATA_LEN)
+    if (_init_config.send_window == 0)
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. Send window size incorrect.");
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifndef CONFIG_IDF_TARGET_ESP8266
+    if (_init_config.task_core_id >= portNUM_PROCESSORS)
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. Task core incorrect.");
+        return ESP_ERR_INVALID_ARG;
+    }
+#endif
+    if (_init_config.queue_high_watermark != 0 && (_init_config.queue_high_watermark > _init_config.queue_size || _init_config.queue_low_watermark >= _init_config.queue_high_watermark))
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. Queue watermark incorrect.");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (_init_config.queue_size == 0 || _init_config.rx_queue_size == 0 || _init_config.control_queue_size == 0 || _init_config.confirm_queue_size == 0 || _init_config.forward_queue_size == 0)
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. Queue size incorrect.");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (_init_config.id_vector_size == 0)
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. ID vector size incorrect.");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (_init_config.route_vector_size == 0)
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. Route vector size incorrect.");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (sizeof(_message_t) > ESP_NOW_MAX_DATA_LEN)
     {
         ESP_LOGE(TAG, "ESP-NOW initialization fail. The maximum value of the transmitted data size is incorrect.");
         return ESP_ERR_INVALID_ARG;
@@ -109,18 +535,119 @@ esp_err_t zh_network_init(const zh_network_init_config_t *config)
     {
         esp_read_mac(_self_mac, ESP_MAC_WIFI_SOFTAP);
     }
-    _event_group_handle = xEventGroupCreate();
     _queue_handle = xQueueCreate(_init_config.queue_size, sizeof(_queue_t));
-    zh_vector_init(&_id_vector, sizeof(uint32_t), false);
-    zh_vector_init(&_route_vector, sizeof(_routing_table_t), false);
-    zh_vector_init(&_response_vector, sizeof(uint32_t), false);
-    _id_vector_mutex = xSemaphoreCreateMutex();
+    _rx_queue_handle = xQueueCreate(_init_config.rx_queue_size, sizeof(_queue_t));
+    _control_queue_handle = xQueueCreate(_init_config.control_queue_size, sizeof(_queue_t));
+    _confirm_queue_handle = xQueueCreate(_init_config.confirm_queue_size, sizeof(_queue_t));
+    _forward_queue_handle = xQueueCreate(_init_config.forward_queue_size, sizeof(_queue_t));
+    _send_result_queue_handle = xQueueCreate(_init_config.send_window, sizeof(_send_result_t));
+    _pending_table = heap_caps_calloc(_init_config.queue_size, sizeof(_pending_t), MALLOC_CAP_8BIT);
+    _inflight_table = heap_caps_calloc(_init_config.send_window, sizeof(_inflight_t), MALLOC_CAP_8BIT);
+    _id_cache = heap_caps_calloc(_init_config.id_vector_size, sizeof(_id_cache_t), MALLOC_CAP_8BIT);
+    _route_table = heap_caps_calloc(_init_config.route_vector_size, sizeof(_routing_table_t), MALLOC_CAP_8BIT);
+    _link_table = heap_caps_calloc(_init_config.route_vector_size, sizeof(_link_t), MALLOC_CAP_8BIT);
+    _discovery_table = heap_caps_calloc(_init_config.queue_size, sizeof(_discovery_t), MALLOC_CAP_8BIT);
+    _ack_table = heap_caps_calloc(_init_config.confirm_queue_size, sizeof(_ack_t), MALLOC_CAP_8BIT);
+    _origin_table = heap_caps_calloc(_init_config.forward_queue_size, sizeof(_origin_t), MALLOC_CAP_8BIT);
+    if (_init_config.data_pool_size != 0)
+    {
+        _data_pool = heap_caps_calloc(_init_config.data_pool_size, ZH_NETWORK_MAX_MESSAGE_SIZE, MALLOC_CAP_8BIT);
+        _data_pool_free = heap_caps_calloc(_init_config.data_pool_size, sizeof(uint8_t), MALLOC_CAP_8BIT);
+        if (_data_pool == NULL || _data_pool_free == NULL)
+        {
+            ESP_LOGE(TAG, "ESP-NOW initialization fail. Memory allocation fail or no free memory in the heap.");
+            return ESP_FAIL;
+        }
+        for (uint8_t i = 0; i < _init_config.data_pool_size; ++i)
+        {
+            _data_pool_free[i] = i;
+        }
+    }
+    _data_pool_free_count = _init_config.data_pool_size;
+    if (_init_config.aggregate_linger != 0)
+    {
+        _aggregate_table = heap_caps_calloc(_init_config.send_window, sizeof(_aggregate_t), MALLOC_CAP_8BIT);
+        if (_aggregate_table == NULL || _inflight_table == NULL)
+        {
+            ESP_LOGE(TAG, "ESP-NOW initialization fail. Memory allocation fail or no free memory in the heap.");
+            return ESP_FAIL;
+        }
+        for (uint8_t i = 0; i < _init_config.send_window; ++i)
+        {
+#ifdef CONFIG_ZH_NETWORK_ESPNOW_V2
+            _aggregate_table[i].payload = heap_caps_calloc(1, MAX_FRAME_SIZE - MESSAGE_HEADER_SIZE, MALLOC_CAP_8BIT);
+            _inflight_table[i].frame = heap_caps_calloc(1, MAX_FRAME_SIZE, MALLOC_CAP_8BIT);
+            if (_aggregate_table[i].payload == NULL || _inflight_table[i].frame == NULL)
+            {
+                ESP_LOGE(TAG, "ESP-NOW initialization fail. Memory allocation fail or no free memory in the heap.");
+                return ESP_FAIL;
+            }
+#else
+            _aggregate_table[i].payload = _aggregate_table[i].queue.data.payload;
+#endif
+        }
+    }
+    if (_init_config.flood_table_size != 0)
+    {
+        _flood_table = heap_caps_calloc(_init_config.flood_table_size, sizeof(_pending_t), MALLOC_CAP_8BIT);
+        if (_flood_table == NULL)
+        {
+            ESP_LOGE(TAG, "ESP-NOW initialization fail. Memory allocation fail or no free memory in the heap.");
+            return ESP_FAIL;
+        }
+    }
+    if (_init_config.group_table_size != 0)
+    {
+        _group_table = heap_caps_calloc(_init_config.group_table_size, sizeof(uint16_t), MALLOC_CAP_8BIT);
+        if (_group_table == NULL)
+        {
+            ESP_LOGE(TAG, "ESP-NOW initialization fail. Memory allocation fail or no free memory in the heap.");
+            return ESP_FAIL;
+        }
+    }
+    _group_count = 0;
+    if (_init_config.fragment_table_size != 0)
+    {
+        _fragment_tx_table = heap_caps_calloc(_init_config.fragment_table_size, sizeof(_fragment_tx_t), MALLOC_CAP_8BIT);
+        _fragment_rx_table = heap_caps_calloc(_init_config.fragment_table_size, sizeof(_fragment_rx_t), MALLOC_CAP_8BIT);
+        if (_fragment_tx_table == NULL || _fragment_rx_table == NULL)
+        {
+            ESP_LOGE(TAG, "ESP-NOW initialization fail. Memory allocation fail or no free memory in the heap.");
+            return ESP_FAIL;
+        }
+    }
+    memset(&_stats, 0, sizeof(_stats));
+    _message_id = esp_random();
+    _sent_message_id = _message_id;
+    if (_queue_handle == NULL || _rx_queue_handle == NULL || _control_queue_handle == NULL || _confirm_queue_handle == NULL || _forward_queue_handle == NULL || _send_result_queue_handle == NULL)
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. Memory allocation fail or no free memory in the heap.");
+        return ESP_FAIL;
+    }
+    if (_pending_table == NULL || _inflight_table == NULL || _id_cache == NULL || _route_table == NULL || _link_table == NULL || _discovery_table == NULL || _ack_table == NULL || _origin_table == NULL)
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. Memory allocation fail or no free memory in the heap.");
+        return ESP_FAIL;
+    }
     if (esp_now_init() != ESP_OK || esp_now_register_send_cb(_send_cb) != ESP_OK || esp_now_register_recv_cb(_recv_cb) != ESP_OK)
     {
         ESP_LOGE(TAG, "ESP-NOW initialization fail. Internal error.");
         return ESP_FAIL;
     }
-    if (xTaskCreatePinnedToCore(&_processing, "NULL", _init_config.stack_size, NULL, _init_config.task_priority, &_processing_task_handle, tskNO_AFFINITY) != pdPASS)
+    memset(_peer_cache, 0, sizeof(_peer_cache));
+    if (_peer_add(_broadcast_mac) != true)
+    {
+        ESP_LOGE(TAG, "ESP-NOW initialization fail. Internal error with adding peer.");
+        return ESP_FAIL;
+    }
+    _is_queue_high = false;
+    _route_is_changed = false;
+    _route_save_time = esp_timer_get_time() / 1000;
+    if (_init_config.route_save_interval != 0)
+    {
+        _route_load();
+    }
+    if (xTaskCreatePinnedToCore(&_processing, "NULL", _init_config.stack_size, NULL, _init_config.task_priority, &_processing_task_handle, (_init_config.task_core_id < 0) ? tskNO_AFFINITY : _init_config.task_core_id) != pdPASS)
     {
         ESP_LOGE(TAG, "ESP-NOW initialization fail. Internal error.");
         return ESP_FAIL;
@@ -138,49 +665,125 @@ esp_err_t zh_network_deinit(void)
         ESP_LOGE(TAG, "ESP-NOW deinitialization fail. ESP-NOW not initialized.");
         return ESP_FAIL;
     }
-    vEventGroupDelete(_event_group_handle);
     vQueueDelete(_queue_handle);
+    vQueueDelete(_rx_queue_handle);
+    vQueueDelete(_control_queue_handle);
+    vQueueDelete(_confirm_queue_handle);
+    vQueueDelete(_forward_queue_handle);
+    vQueueDelete(_send_result_queue_handle);
     esp_now_unregister_send_cb();
     esp_now_unregister_recv_cb();
     esp_now_deinit();
-    zh_vector_free(&_id_vector);
-    zh_vector_free(&_route_vector);
-    zh_vector_free(&_response_vector);
     vTaskDelete(_processing_task_handle);
+    if (_init_config.route_save_interval != 0 && _route_is_changed == true)
+    {
+        _route_save();
+    }
+    heap_caps_free(_pending_table);
+    _pending_table = NULL;
+    heap_caps_free(_flood_table);
+    _flood_table = NULL;
+#ifdef CONFIG_ZH_NETWORK_ESPNOW_V2
+    for (uint8_t i = 0; _aggregate_table != NULL && i < _init_config.send_window; ++i)
+    {
+        heap_caps_free(_aggregate_table[i].payload);
+        heap_caps_free(_inflight_table[i].frame);
+    }
+#endif
+    heap_caps_free(_inflight_table);
+    _inflight_table = NULL;
+    heap_caps_free(_id_cache);
+    _id_cache = NULL;
+    heap_caps_free(_route_table);
+    _route_table = NULL;
+    heap_caps_free(_link_table);
+    _link_table = NULL;
+    heap_caps_free(_discovery_table);
+    _discovery_table = NULL;
+    heap_caps_free(_ack_table);
+    _ack_table = NULL;
+    heap_caps_free(_origin_table);
+    _origin_table = NULL;
+    heap_caps_free(_data_pool);
+    _data_pool = NULL;
+    heap_caps_free(_data_pool_free);
+    _data_pool_free = NULL;
+    for (uint8_t i = 0; i < _init_config.fragment_table_size; ++i)
+    {
+        heap_caps_free(_fragment_tx_table[i].data);
+        heap_caps_free(_fragment_rx_table[i].data);
+    }
+    heap_caps_free(_fragment_tx_table);
+    _fragment_tx_table = NULL;
+    heap_caps_free(_aggregate_table);
+    _aggregate_table = NULL;
+    heap_caps_free(_group_table);
+    _group_table = NULL;
+    _group_count = 0;
+    heap_caps_free(_fragment_rx_table);
+    _fragment_rx_table = NULL;
+    _on_recv_cb = NULL;
+    _on_send_cb = NULL;
+    _on_send_cb_arg = NULL;
     _is_initialized = false;
     ESP_LOGI(TAG, "ESP-NOW deinitialization success.");
     return ESP_OK;
 }
 
 esp_err_t zh_network_send(const uint8_t *target, const uint8_t *data, const uint8_t data_len)
+{
+    return zh_network_send_ex(target, data, data_len, ZH_NETWORK_DELIVERY_CONFIRMED, NULL);
+}
+
+esp_err_t zh_network_send_ex(const uint8_t *target, const uint8_t *data, const uint8_t data_len, const zh_network_delivery_mode_t delivery_mode, uint32_t *message_id)
+{
+    return _send(target, data, data_len, delivery_mode, message_id, 0);
+}
+
+esp_err_t zh_network_send_blocking(const uint8_t *target, const uint8_t *data, const uint8_t data_len, const uint32_t timeout)
+{
+    return _send(target, data, data_len, ZH_NETWORK_DELIVERY_CONFIRMED, NULL, (timeout / portTICK_PERIOD_MS == 0) ? 1 : timeout / portTICK_PERIOD_MS);
+}
+
+esp_err_t zh_network_send_group(const uint16_t group_id, const uint8_t *data, const uint8_t data_len)
+{
+    uint8_t target[6] = {0};
+    _group_get_mac(group_id, target);
+    return _send(target, data, data_len, ZH_NETWORK_DELIVERY_CONFIRMED, NULL, 0);
+}
+
+static esp_err_t _send(const uint8_t *target, const uint8_t *data, const uint8_t data_len, const zh_network_delivery_mode_t delivery_mode, uint32_t *message_id, const TickType_t wait_time)
 {
     if (target == NULL)
     {
-        ESP_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC FF:FF:FF:FF:FF:FF to queue begin.");
+        HOT_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC FF:FF:FF:FF:FF:FF to queue begin.");
     }
     else
     {
-        ESP_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC %02X:%02X:%02X:%02X:%02X:%02X to queue begin.", MAC2STR(target));
+        HOT_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC %02X:%02X:%02X:%02X:%02X:%02X to queue begin.", MAC2STR(target));
     }
     if (_is_initialized == false)
     {
         ESP_LOGE(TAG, "Adding outgoing ESP-NOW data to queue fail. ESP-NOW not initialized.");
         return ESP_FAIL;
     }
-    if (data_len == 0 || data == NULL || data_len > ZH_NETWORK_MAX_MESSAGE_SIZE)
+    if (data_len == 0 || data == NULL || data_len > ZH_NETWORK_MAX_MESSAGE_SIZE || delivery_mode > ZH_NETWORK_DELIVERY_NONE)
     {
         ESP_LOGE(TAG, "Adding outgoing ESP-NOW data to queue fail. Invalid argument.");
         return ESP_ERR_INVALID_ARG;
     }
-    if (uxQueueSpacesAvailable(_queue_handle) < _init_config.queue_size / 2)
+    if (wait_time == 0 && uxQueueSpacesAvailable(_queue_handle) == 0)
     {
-        ESP_LOGW(TAG, "Adding outgoing ESP-NOW data to queue fail. Queue is almost full.");
+        HOT_LOGW(TAG, "Adding outgoing ESP-NOW data to queue fail. Queue is full.");
+        _stats_inc(&_stats.send_queue_full);
         return ESP_ERR_INVALID_STATE;
     }
     _queue_t queue = {0};
     queue.id = TO_SEND;
     queue.data.network_id = _init_config.network_id;
-    queue.data.message_id = abs(esp_random()); // It is not clear why esp_random() sometimes gives negative values.
+    queue.data.message_id = _get_message_id();
+    queue.send_id = queue.data.message_id;
+    queue.data.delivery_mode = delivery_mode;
     memcpy(queue.data.original_sender_mac, _self_mac, 6);
     if (target == NULL)
     {
@@ -189,7 +792,12 @@ esp_err_t zh_network_send(const uint8_t *target, const uint8_t *data, const uint
     }
     else
     {
-        if (memcmp(target, _broadcast_mac, 6) != 0)
+        if (_group_is_mac(target) == true)
+        {
+            queue.data.message_type = MULTICAST;
+            memcpy(queue.data.original_target_mac, target, 6);
+        }
+        else if (memcmp(target, _broadcast_mac, 6) != 0)
         {
             queue.data.message_type = UNICAST;
             memcpy(queue.data.original_target_mac, target, 6);
@@ -204,652 +812,2854 @@ esp_err_t zh_network_send(const uint8_t *target, const uint8_t *data, const uint
     queue.data.payload_len = data_len;
     if (target == NULL)
     {
-        ESP_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC FF:FF:FF:FF:FF:FF to queue success.");
+        HOT_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC FF:FF:FF:FF:FF:FF to queue success.");
     }
     else
     {
-        ESP_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC %02X:%02X:%02X:%02X:%02X:%02X to queue success.", MAC2STR(target));
+        HOT_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC %02X:%02X:%02X:%02X:%02X:%02X to queue success.", MAC2STR(target));
     }
-    if (xQueueSend(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+    LATENCY_STAMP(&queue);
+    if (xQueueSend(_queue_handle, &queue, (wait_time == 0) ? portTICK_PERIOD_MS : wait_time) != pdTRUE)
     {
+        if (wait_time != 0)
+        {
+            HOT_LOGW(TAG, "Adding outgoing ESP-NOW data to queue fail. Time for waiting free space in the queue is expired.");
+            _stats_inc(&_stats.send_queue_full);
+            return ESP_ERR_TIMEOUT;
+        }
         ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
         return ESP_FAIL;
     }
+    _stats_high_water(&_stats.queue_high_water, _queue_handle, _init_config.queue_size);
+    xTaskNotifyGive(_processing_task_handle);
+    _queue_watermark_check();
+    if (message_id != NULL)
+    {
+        *message_id = queue.send_id;
+    }
     return ESP_OK;
 }
 
-static void _send_cb(const uint8_t *mac_addr, esp_now_send_status_t status)
+esp_err_t zh_network_send_large(const uint8_t *target, const uint8_t *data, const uint16_t data_len)
 {
-    if (status == ESP_NOW_SEND_SUCCESS)
+    if (_is_initialized == false)
     {
-        xEventGroupSetBits(_event_group_handle, DATA_SEND_SUCCESS);
+        ESP_LOGE(TAG, "Adding outgoing ESP-NOW data to queue fail. ESP-NOW not initialized.");
+        return ESP_FAIL;
     }
-    else
+    if (target == NULL || memcmp(target, _broadcast_mac, 6) == 0 || _group_is_mac(target) == true || data_len == 0 || data == NULL || data_len > MAX_FRAGMENT_COUNT * FRAGMENT_DATA_SIZE)
     {
-        xEventGroupSetBits(_event_group_handle, DATA_SEND_FAIL);
+        ESP_LOGE(TAG, "Adding outgoing ESP-NOW data to queue fail. Invalid argument.");
+        return ESP_ERR_INVALID_ARG;
     }
-}
-
-#if defined CONFIG_IDF_TARGET_ESP8266 || ESP_IDF_VERSION_MAJOR == 4
-static void _recv_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len)
-#else
-static void _recv_cb(const esp_now_recv_info_t *esp_now_info, const uint8_t *data, int data_len)
-#endif
-{
-#if defined CONFIG_IDF_TARGET_ESP8266 || ESP_IDF_VERSION_MAJOR == 4
-    ESP_LOGI(TAG, "Adding incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to queue begin.", MAC2STR(mac_addr));
-#else
-    ESP_LOGI(TAG, "Adding incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to queue begin.", MAC2STR(esp_now_info->src_addr));
-#endif
-    if (uxQueueSpacesAvailable(_queue_handle) < (_init_config.queue_size - 2))
+    if (data_len <= ZH_NETWORK_MAX_MESSAGE_SIZE)
     {
-        ESP_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Queue is almost full.");
-        return;
+        return zh_network_send(target, data, data_len);
     }
-    if (data_len == sizeof(_queue_t) - 14)
+    HOT_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC %02X:%02X:%02X:%02X:%02X:%02X to fragmentation list begin.", MAC2STR(target));
+    _fragment_tx_t *fragment_tx = NULL;
+    ENTER_CRITICAL();
+    for (uint8_t i = 0; i < _init_config.fragment_table_size; ++i)
     {
-        _queue_t queue = {0};
-        queue.id = ON_RECV;
-        memcpy(&queue.data, data, data_len);
-        if (memcmp(&queue.data.network_id, &_init_config.network_id, sizeof(queue.data.network_id)) != 0)
-        {
-            ESP_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Incorrect mesh network ID.");
-            return;
-        }
-        for (uint16_t i = 0; i < zh_vector_get_size(&_id_vector); ++i)
-        {
-            uint32_t *message_id = zh_vector_get_item(&_id_vector, i);
-            if (memcmp(&queue.data.message_id, message_id, sizeof(queue.data.message_id)) == 0)
-            {
-                ESP_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Repeat message received.");
-                return;
-            }
-        }
-        if (xSemaphoreTake(_id_vector_mutex, portTICK_PERIOD_MS) == pdTRUE)
-        {
-            zh_vector_push_back(&_id_vector, &queue.data.message_id);
-            if (zh_vector_get_size(&_id_vector) > _init_config.id_vector_size)
-            {
-                zh_vector_delete_item(&_id_vector, 0);
-            }
-            xSemaphoreGive(_id_vector_mutex);
-        }
-#if defined CONFIG_IDF_TARGET_ESP8266 || ESP_IDF_VERSION_MAJOR == 4
-        memcpy(queue.data.sender_mac, mac_addr, 6);
-#else
-        memcpy(queue.data.sender_mac, esp_now_info->src_addr, 6);
-#endif
-#if defined CONFIG_IDF_TARGET_ESP8266 || ESP_IDF_VERSION_MAJOR == 4
-        ESP_LOGI(TAG, "Adding incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to queue success.", MAC2STR(mac_addr));
-#else
-        ESP_LOGI(TAG, "Adding incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to queue success.", MAC2STR(esp_now_info->src_addr));
-#endif
-        if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+        if (_fragment_tx_table[i].state == FRAGMENT_FREE)
         {
-            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+            fragment_tx = &_fragment_tx_table[i];
+            fragment_tx->state = FRAGMENT_RESERVED;
+            break;
         }
     }
-    else
+    EXIT_CRITICAL();
+    if (fragment_tx == NULL)
+    {
+        HOT_LOGW(TAG, "Adding outgoing ESP-NOW data to fragmentation list fail. List is full.");
+        _stats_inc(&_stats.send_queue_full);
+        return ESP_ERR_INVALID_STATE;
+    }
+    fragment_tx->data = heap_caps_malloc(data_len, MALLOC_CAP_8BIT);
+    if (fragment_tx->data == NULL)
     {
-        ESP_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Incorrect ESP-NOW data size.");
+        ESP_LOGE(TAG, "Adding outgoing ESP-NOW data to fragmentation list fail. Memory allocation fail or no free memory in the heap.");
+        fragment_tx->state = FRAGMENT_FREE;
+        return ESP_FAIL;
     }
+    memcpy(fragment_tx->data, data, data_len);
+    memcpy(fragment_tx->target_mac, target, 6);
+    fragment_tx->data_len = data_len;
+    fragment_tx->count = (data_len + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE;
+    fragment_tx->transfer_id = _get_message_id();
+    fragment_tx->confirmed = 0;
+    fragment_tx->attempts = 1;
+    fragment_tx->index = 0;
+    ENTER_CRITICAL();
+    fragment_tx->state = FRAGMENT_SENDING;
+    EXIT_CRITICAL();
+    HOT_LOGI(TAG, "Adding outgoing ESP-NOW data to MAC %02X:%02X:%02X:%02X:%02X:%02X to fragmentation list success. Data will be sent in %d fragments.", MAC2STR(target), fragment_tx->count);
+    xTaskNotifyGive(_processing_task_handle);
+    return ESP_OK;
 }
 
-static void _processing(void *pvParameter)
+esp_err_t zh_network_register_recv_cb(zh_network_recv_cb_t cb)
 {
-    _queue_t queue = {0};
-    while (xQueueReceive(_queue_handle, &queue, portMAX_DELAY) == pdTRUE)
+    if (_is_initialized == false)
     {
-        bool flag = false;
-        switch (queue.id)
+        ESP_LOGE(TAG, "ESP-NOW receive callback registration fail. ESP-NOW not initialized.");
+        return ESP_FAIL;
+    }
+    _on_recv_cb = cb;
+    ESP_LOGI(TAG, "ESP-NOW receive callback registration success.");
+    return ESP_OK;
+}
+
+esp_err_t zh_network_register_send_cb(zh_network_send_cb_t cb, void *arg)
+{
+    if (_is_initialized == false)
+    {
+        ESP_LOGE(TAG, "ESP-NOW send callback registration fail. ESP-NOW not initialized.");
+        return ESP_FAIL;
+    }
+    ENTER_CRITICAL();
+    _on_send_cb = cb;
+    _on_send_cb_arg = arg;
+    EXIT_CRITICAL();
+    ESP_LOGI(TAG, "ESP-NOW send callback registration success.");
+    return ESP_OK;
+}
+
+esp_err_t zh_network_join_group(const uint16_t group_id)
+{
+    if (_is_initialized == false)
+    {
+        ESP_LOGE(TAG, "ESP-NOW group joining fail. ESP-NOW not initialized.");
+        return ESP_FAIL;
+    }
+    ENTER_CRITICAL();
+    for (uint8_t i = 0; i < _group_count; ++i)
+    {
+        if (_group_table[i] == group_id)
+        {
+            EXIT_CRITICAL();
+            return ESP_OK;
+        }
+    }
+    if (_group_count >= _init_config.group_table_size)
+    {
+        EXIT_CRITICAL();
+        ESP_LOGE(TAG, "ESP-NOW group %d joining fail. Group table is full.", group_id);
+        return ESP_ERR_NO_MEM;
+    }
+    _group_table[_group_count++] = group_id;
+    EXIT_CRITICAL();
+    ESP_LOGI(TAG, "ESP-NOW group %d joining success.", group_id);
+    return ESP_OK;
+}
+
+esp_err_t zh_network_leave_group(const uint16_t group_id)
+{
+    if (_is_initialized == false)
+    {
+        ESP_LOGE(TAG, "ESP-NOW group leaving fail. ESP-NOW not initialized.");
+        return ESP_FAIL;
+    }
+    ENTER_CRITICAL();
+    for (uint8_t i = 0; i < _group_count; ++i)
+    {
+        if (_group_table[i] == group_id)
+        {
+            _group_table[i] = _group_table[--_group_count];
+            EXIT_CRITICAL();
+            ESP_LOGI(TAG, "ESP-NOW group %d leaving success.", group_id);
+            return ESP_OK;
+        }
+    }
+    EXIT_CRITICAL();
+    ESP_LOGW(TAG, "ESP-NOW group %d leaving fail. The device is not a member of the group.", group_id);
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t zh_network_free_data(uint8_t *data)
+{
+    if (data == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (_data_pool != NULL && data >= _data_pool && data < _data_pool + _init_config.data_pool_size * ZH_NETWORK_MAX_MESSAGE_SIZE)
+    {
+        ENTER_CRITICAL();
+        _data_pool_free[_data_pool_free_count++] = (data - _data_pool) / ZH_NETWORK_MAX_MESSAGE_SIZE;
+        EXIT_CRITICAL();
+        return ESP_OK;
+    }
+    heap_caps_free(data);
+    return ESP_OK;
+}
+
+uint32_t zh_network_get_data_pool_exhausted(void)
+{
+    return _stats.data_pool_exhausted;
+}
+
+esp_err_t zh_network_get_stats(zh_network_stats_t *stats)
+{
+    if (stats == NULL)
+    {
+        ESP_LOGE(TAG, "ESP-NOW statistics reading fail. Invalid argument.");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (_is_initialized == false)
+    {
+        ESP_LOGE(TAG, "ESP-NOW statistics reading fail. ESP-NOW not initialized.");
+        return ESP_FAIL;
+    }
+    ENTER_CRITICAL();
+    *stats = _stats;
+    EXIT_CRITICAL();
+    return ESP_OK;
+}
+
+esp_err_t zh_network_reset_stats(void)
+{
+    if (_is_initialized == false)
+    {
+        ESP_LOGE(TAG, "ESP-NOW statistics reset fail. ESP-NOW not initialized.");
+        return ESP_FAIL;
+    }
+    ENTER_CRITICAL();
+    memset(&_stats, 0, sizeof(_stats));
+#ifdef CONFIG_ZH_NETWORK_LATENCY
+    memset(&_latency, 0, sizeof(_latency));
+#endif
+    EXIT_CRITICAL();
+    return ESP_OK;
+}
+
+esp_err_t zh_network_get_latency(zh_network_latency_t *latency)
+{
+#ifdef CONFIG_ZH_NETWORK_LATENCY
+    if (latency == NULL)
+    {
+        ESP_LOGE(TAG, "ESP-NOW latency reading fail. Invalid argument.");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (_is_initialized == false)
+    {
+        ESP_LOGE(TAG, "ESP-NOW latency reading fail. ESP-NOW not initialized.");
+        return ESP_FAIL;
+    }
+    ENTER_CRITICAL();
+    *latency = _latency;
+    EXIT_CRITICAL();
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t zh_network_dump_trace(void)
+{
+#ifdef CONFIG_ZH_NETWORK_TRACE
+    static const char *event_name[] = {"RECV", "DROP_REPEAT", "DROP_QUEUE", "DROP_HOPS", "DELIVER", "SEND", "SEND_SUCCESS", "SEND_FAIL", "CONFIRM", "TIMEOUT"};
+    static const char *message_type_name[] = {"BROADCAST", "UNICAST", "DELIVERY_CONFIRM", "SEARCH_REQUEST", "SEARCH_RESPONSE", "FRAGMENT", "FRAGMENT_CONFIRM", "AGGREGATE", "MULTICAST"};
+    _trace_t *trace = heap_caps_malloc(sizeof(_trace_ring), MALLOC_CAP_8BIT);
+    if (trace == NULL)
+    {
+        ESP_LOGE(TAG, "ESP-NOW trace dump fail. Memory allocation fail or no free memory in the heap.");
+        return ESP_FAIL;
+    }
+    ENTER_CRITICAL();
+    uint16_t count = _trace_count;
+    uint16_t first = (_trace_head + CONFIG_ZH_NETWORK_TRACE_SIZE - count) % CONFIG_ZH_NETWORK_TRACE_SIZE;
+    memcpy(trace, _trace_ring, sizeof(_trace_ring));
+    EXIT_CRITICAL();
+    printf("zh_network trace, %d records:\n", count);
+    for (uint16_t i = 0; i < count; ++i)
+    {
+        _trace_t *item = &trace[(first + i) % CONFIG_ZH_NETWORK_TRACE_SIZE];
+        printf("%lu %s %s id %08lX hops %d from %02X:%02X:%02X:%02X:%02X:%02X to %02X:%02X:%02X:%02X:%02X:%02X via %02X:%02X:%02X:%02X:%02X:%02X\n", (unsigned long)item->time, event_name[item->event], (item->message_type < sizeof(message_type_name) / sizeof(message_type_name[0])) ? message_type_name[item->message_type] : "UNKNOWN", (unsigned long)item->message_id, item->hop_count, MAC2STR(item->original_sender_mac), MAC2STR(item->original_target_mac), MAC2STR(item->sender_mac));
+    }
+    heap_caps_free(trace);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static void _send_cb(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+    _send_result_t send_result = {0};
+    memcpy(send_result.mac_addr, mac_addr, 6);
+    send_result.status = status;
+    if (xQueueSend(_send_result_queue_handle, &send_result, 0) != pdTRUE)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+    }
+    xTaskNotifyGive(_processing_task_handle);
+}
+
+#if defined CONFIG_IDF_TARGET_ESP8266 || ESP_IDF_VERSION_MAJOR == 4
+static void _recv_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+#else
+static void _recv_cb(const esp_now_recv_info_t *esp_now_info, const uint8_t *data, int data_len)
+#endif
+{
+#if defined CONFIG_IDF_TARGET_ESP8266 || ESP_IDF_VERSION_MAJOR == 4
+    _recv_frame(mac_addr, 0, data, data_len, false);
+#else
+    _recv_frame(esp_now_info->src_addr, esp_now_info->rx_ctrl->rssi, data, data_len, false);
+#endif
+}
+
+static void _recv_frame(const uint8_t *src_addr, const int8_t rssi, const uint8_t *data, const int data_len, const bool is_inner)
+{
+    HOT_LOGI(TAG, "Adding incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to queue begin.", MAC2STR(src_addr));
+    if (uxQueueSpacesAvailable(_rx_queue_handle) == 0)
+    {
+        HOT_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Queue is full.");
+        _stats_inc(&_stats.recv_queue_full);
+        return;
+    }
+    if (is_inner == false && data_len > sizeof(_message_t) && data_len <= MAX_FRAME_SIZE && ((const _message_t *)data)->message_type == AGGREGATE && ((const _message_t *)data)->payload_len == 0) // ESP-NOW v2 frame with packed messages. The payload takes the rest of the frame.
+    {
+        if (memcmp(&((const _message_t *)data)->network_id, &_init_config.network_id, sizeof(_init_config.network_id)) != 0)
+        {
+            HOT_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Incorrect mesh network ID.");
+            _stats_inc(&_stats.network_id_mismatch);
+            return;
+        }
+        _stats_inc_type(_stats.received, AGGREGATE);
+        _aggregate_recv(src_addr, rssi, &data[MESSAGE_HEADER_SIZE], data_len - MESSAGE_HEADER_SIZE);
+        return;
+    }
+    _queue_t queue = {0};
+    uint16_t message_len = 0;
+    if (data_len > 0 && (data[0] & COMPACT_FLAG) != 0)
+    {
+        message_len = _compact_decode(src_addr, data, data_len, &queue.data);
+    }
+    else if (data_len >= MESSAGE_HEADER_SIZE && data_len <= sizeof(_message_t) && data_len == MESSAGE_HEADER_SIZE + ((const _message_t *)data)->payload_len)
+    {
+        memcpy(&queue.data, data, data_len);
+        message_len = data_len;
+    }
+    if (message_len != 0)
+    {
+        const _message_t *message = &queue.data;
+        if (memcmp(&message->network_id, &_init_config.network_id, sizeof(message->network_id)) != 0)
+        {
+            HOT_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Incorrect mesh network ID.");
+            _stats_inc(&_stats.network_id_mismatch);
+            return;
+        }
+        if (message->message_type == AGGREGATE)
         {
-        case TO_SEND:
-            ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processing begin.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-            esp_now_peer_info_t *peer = heap_caps_malloc(sizeof(esp_now_peer_info_t), MALLOC_CAP_8BIT);
-            if (peer == NULL)
+            if (is_inner == true)
             {
-                ESP_LOGE(TAG, "Outgoing ESP-NOW data processing fail. Memory allocation fail or no free memory in the heap.");
-                heap_caps_free(peer);
-                break;
+                HOT_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Incorrect ESP-NOW data size.");
+                _stats_inc(&_stats.size_rejected);
+                return;
             }
-            memset(peer, 0, sizeof(esp_now_peer_info_t));
-            peer->ifidx = _init_config.wifi_interface;
-            if (queue.data.message_type == BROADCAST || queue.data.message_type == SEARCH_REQUEST || queue.data.message_type == SEARCH_RESPONSE)
+            _stats_inc_type(_stats.received, AGGREGATE);
+            _aggregate_recv(src_addr, rssi, message->payload, message->payload_len);
+            return;
+        }
+        queue.id = ON_RECV;
+        queue.rssi = rssi;
+        if (memcmp(queue.data.original_sender_mac, _self_mac, 6) == 0 || _id_cache_is_repeat(queue.data.original_sender_mac, queue.data.message_id) == true)
+        {
+            // Repeat routing messages are only used for choosing the route with the lowest path cost. They are added to queue only if at least half of the queue is free.
+            if (memcmp(queue.data.original_sender_mac, _self_mac, 6) == 0 || (queue.data.message_type != SEARCH_REQUEST && queue.data.message_type != SEARCH_RESPONSE) || uxQueueSpacesAvailable(_rx_queue_handle) <= _init_config.rx_queue_size / 2)
             {
-                memcpy(peer->peer_addr, _broadcast_mac, 6);
-                if (memcmp(queue.data.original_sender_mac, _self_mac, 6) == 0)
-                {
-                    if (xSemaphoreTake(_id_vector_mutex, portTICK_PERIOD_MS) == pdTRUE)
-                    {
-                        zh_vector_push_back(&_id_vector, &queue.data.message_id);
-                        if (zh_vector_get_size(&_id_vector) > _init_config.id_vector_size)
-                        {
-                            zh_vector_delete_item(&_id_vector, 0);
-                        }
-                        xSemaphoreGive(_id_vector_mutex);
-                    }
-                }
+                TRACE(TRACE_DROP_REPEAT, &queue.data);
+                _stats_inc(&_stats.duplicates_dropped);
+                HOT_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Repeat message received.");
+                return;
             }
-            else
+            queue.is_repeat = true;
+        }
+        memcpy(queue.data.sender_mac, src_addr, 6);
+        ++queue.data.hop_count;
+        TRACE(TRACE_RECV, &queue.data);
+        HOT_LOGI(TAG, "Adding incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to queue success.", MAC2STR(src_addr));
+        LATENCY_STAMP(&queue);
+        if (xQueueSend(_rx_queue_handle, &queue, 0) != pdTRUE)
+        {
+            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+            _stats_inc(&_stats.recv_queue_full);
+            return;
+        }
+        if (queue.is_repeat == false)
+        {
+            _stats_inc_type(_stats.received, queue.data.message_type);
+        }
+        else
+        {
+            _stats_inc(&_stats.routing_repeats);
+        }
+        _stats_high_water(&_stats.rx_queue_high_water, _rx_queue_handle, _init_config.rx_queue_size);
+        xTaskNotifyGive(_processing_task_handle);
+    }
+    else
+    {
+        HOT_LOGW(TAG, "Adding incoming ESP-NOW data to queue fail. Incorrect ESP-NOW data size.");
+        _stats_inc(&_stats.size_rejected);
+    }
+}
+
+static void _processing(void *pvParameter)
+{
+    _queue_t queue = {0};
+    _send_result_t send_result = {0};
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, _get_wait_time());
+        while (xQueueReceive(_send_result_queue_handle, &send_result, 0) == pdTRUE)
+        {
+            _inflight_result(send_result.mac_addr, send_result.status == ESP_NOW_SEND_SUCCESS);
+        }
+        _inflight_check_timeouts();
+        _pending_check_timeouts();
+        _flood_check_timeouts();
+        _discovery_check_timeouts();
+        _fragment_check_timeouts();
+        _aggregate_check_timeouts();
+        _ack_check_timeouts();
+        _route_save_check();
+        _fragment_send_next();
+        bool is_recv_first = true;
+        while (_queue_pop(&queue, is_recv_first) == true)
+        {
+            is_recv_first = (queue.id != ON_RECV);
+            LATENCY_ADD(ZH_NETWORK_LATENCY_QUEUE, &queue);
+            switch (queue.id)
             {
-                ESP_LOGI(TAG, "Checking routing table to MAC %02X:%02X:%02X:%02X:%02X:%02X.", MAC2STR(queue.data.original_target_mac));
-                for (uint16_t i = 0; i < zh_vector_get_size(&_route_vector); ++i)
+            case TO_SEND:
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processing begin.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                uint8_t peer_addr[6] = {0};
+                if (queue.data.message_type == BROADCAST || queue.data.message_type == MULTICAST || queue.data.message_type == SEARCH_REQUEST || queue.data.message_type == SEARCH_RESPONSE)
                 {
-                    _routing_table_t *routing_table = zh_vector_get_item(&_route_vector, i);
-                    if (memcmp(queue.data.original_target_mac, routing_table->original_target_mac, 6) == 0)
-                    {
-                        memcpy(peer->peer_addr, routing_table->intermediate_target_mac, 6);
-                        flag = true;
-                        ESP_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X is found. Forwarding via MAC %02X:%02X:%02X:%02X:%02X:%02X.", MAC2STR(queue.data.original_target_mac), MAC2STR(peer->peer_addr));
-                        break;
-                    }
+                    memcpy(peer_addr, _broadcast_mac, 6);
                 }
-                if (flag == false)
+                else if (queue.data.message_type == AGGREGATE)
                 {
-                    ESP_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X not found.", MAC2STR(queue.data.original_target_mac));
-                    if (queue.data.message_type == UNICAST)
+                    memcpy(peer_addr, queue.data.original_target_mac, 6);
+                }
+                else
+                {
+                    HOT_LOGI(TAG, "Checking routing table to MAC %02X:%02X:%02X:%02X:%02X:%02X.", MAC2STR(queue.data.original_target_mac));
+                    _routing_table_t *routing_table = _route_find(queue.data.original_target_mac);
+                    if (routing_table != NULL)
                     {
-                        ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        memcpy(peer_addr, routing_table->intermediate_target_mac, 6);
+                        _stats_inc(&_stats.route_hits);
+                        HOT_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X is found. Forwarding via MAC %02X:%02X:%02X:%02X:%02X:%02X.", MAC2STR(queue.data.original_target_mac), MAC2STR(peer_addr));
                     }
                     else
                     {
-                        ESP_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        HOT_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X not found.", MAC2STR(queue.data.original_target_mac));
+                        _stats_inc(&_stats.route_misses);
+                        if (queue.data.message_type == UNICAST)
+                        {
+                            HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        }
+                        else
+                        {
+                            HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        }
+                        queue.id = WAIT_ROUTE;
+                        queue.time = esp_timer_get_time() / 1000;
+                        if (_pending_add(&queue) != true)
+                        {
+                            _pending_add_fail(&queue);
+                            break;
+                        }
+                        _discovery_start(queue.data.original_target_mac);
+                        break;
                     }
-                    queue.id = WAIT_ROUTE;
-                    queue.time = esp_timer_get_time() / 1000;
-                    if (xQueueSend(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+                }
+                if (queue.is_numbered == false && queue.data.message_type != AGGREGATE && memcmp(queue.data.original_sender_mac, _self_mac, 6) == 0)
+                {
+                    // A message that waited for a route or was overtaken by newer system messages could be behind the repeat detection window of the other nodes. It gets a new message ID.
+                    if ((int32_t)(_sent_message_id - queue.data.message_id) >= ID_WINDOW_SIZE / 2)
                     {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+                        queue.data.message_id = _get_message_id();
                     }
-                    ESP_LOGI(TAG, "System message for routing request from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    queue.id = TO_SEND;
-                    queue.data.message_type = SEARCH_REQUEST;
-                    memcpy(queue.data.original_sender_mac, _self_mac, 6);
-                    queue.data.payload_len = 0;
-                    memset(queue.data.payload, 0, ZH_NETWORK_MAX_MESSAGE_SIZE);
-                    queue.data.message_id = abs(esp_random()); // It is not clear why esp_random() sometimes gives negative values.
-                    ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+                    if ((int32_t)(queue.data.message_id - _sent_message_id) > 0)
                     {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+                        _sent_message_id = queue.data.message_id;
                     }
-                    heap_caps_free(peer);
+                    queue.is_numbered = true;
+                }
+                if (queue.data.message_type != AGGREGATE && _aggregate_add(&queue, peer_addr) == true)
+                {
                     break;
                 }
-            }
-            if (esp_now_add_peer(peer) != ESP_OK)
-            {
-                ESP_LOGE(TAG, "Outgoing ESP-NOW data processing fail. Internal error with adding peer.");
-                heap_caps_free(peer);
-                break;
-            }
-            zh_network_event_on_send_t *on_send = heap_caps_malloc(sizeof(zh_network_event_on_send_t), MALLOC_CAP_8BIT);
-            if (on_send == NULL)
-            {
-                ESP_LOGE(TAG, "Outgoing ESP-NOW data processing fail. Memory allocation fail or no free memory in the heap.");
-                heap_caps_free(peer);
-                heap_caps_free(on_send);
-                break;
-            }
-            memset(on_send, 0, sizeof(zh_network_event_on_send_t));
-            memcpy(on_send->mac_addr, queue.data.original_target_mac, 6);
-        SEND:
-            ++_attempts;
-            if (esp_now_send((uint8_t *)peer->peer_addr, (uint8_t *)&queue.data, sizeof(_queue_t) - 14) != ESP_OK)
-            {
-                ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                heap_caps_free(peer);
-                heap_caps_free(on_send);
-                break;
-            }
-            EventBits_t bit = xEventGroupWaitBits(_event_group_handle, DATA_SEND_SUCCESS | DATA_SEND_FAIL, pdTRUE, pdFALSE, 50 / portTICK_PERIOD_MS);
-            if ((bit & DATA_SEND_SUCCESS) != 0)
-            {
-                _attempts = 0;
-                if (memcmp(queue.data.original_sender_mac, _self_mac, 6) == 0)
+                _inflight_t *inflight = _inflight_get_free();
+                if (inflight == NULL)
                 {
-                    if (queue.data.message_type == BROADCAST)
+                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+                    if (queue.data.message_type == AGGREGATE)
                     {
-                        ESP_LOGI(TAG, "Broadcast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        on_send->status = ZH_NETWORK_SEND_SUCCESS;
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_SEND_EVENT, on_send, sizeof(zh_network_event_on_send_t), portTICK_PERIOD_MS) != ESP_OK)
-                        {
-                            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                        }
+                        _aggregate_complete(&queue, peer_addr, queue.data.payload, queue.data.payload_len, false);
                     }
-                    if (queue.data.message_type == SEARCH_REQUEST)
+                    else
                     {
-                        ESP_LOGI(TAG, "System message for routing request from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        _send_complete(&queue, peer_addr, false);
                     }
-                    if (queue.data.message_type == SEARCH_RESPONSE)
+                    break;
+                }
+                inflight->queue = queue;
+                memcpy(inflight->peer_addr, peer_addr, 6);
+                inflight->attempts = 0;
+                inflight->frame_len = 0;
+                if (queue.data.message_type == AGGREGATE && queue.data.payload_len == 0 && _aggregate_take(peer_addr, inflight) != true)
+                {
+                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+                    break;
+                }
+                if (_peer_add(peer_addr) != true)
+                {
+                    ESP_LOGE(TAG, "Outgoing ESP-NOW data processing fail. Internal error with adding peer.");
+                    inflight->attempts = _init_config.attempts; // The message is completed as failed without repeated attempts.
+                    _inflight_complete(inflight, false);
+                    break;
+                }
+                _inflight_send(inflight);
+                break;
+            case ON_RECV:
+                HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processing begin.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                _link_recv(queue.data.sender_mac, queue.rssi);
+                if (queue.data.message_type != SEARCH_REQUEST && queue.data.message_type != SEARCH_RESPONSE)
+                {
+                    _route_learn(&queue.data);
+                }
+                switch (queue.data.message_type)
+                {
+                case BROADCAST:
+                    HOT_LOGI(TAG, "Broadcast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    if (_recv_notify(&queue) != true)
                     {
-                        ESP_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        break;
                     }
-                    if (queue.data.message_type == DELIVERY_CONFIRM)
+                    HOT_LOGI(TAG, "Broadcast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for resend to all nodes.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    _flood_forward(&queue);
+                    break;
+                case MULTICAST:
+                    HOT_LOGI(TAG, "Multicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    if (_group_is_member(queue.data.original_target_mac) == true)
                     {
-                        ESP_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac), MAC2STR(peer->peer_addr));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        if (_recv_notify(&queue) != true)
+                        {
+                            break;
+                        }
+                        HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
                     }
-                    if (queue.data.message_type == UNICAST)
+                    HOT_LOGI(TAG, "Multicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for resend to all nodes.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    _flood_forward(&queue);
+                    break;
+                case UNICAST:
+                    HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    if (memcmp(queue.data.original_target_mac, _self_mac, 6) == 0)
                     {
-                        ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac), MAC2STR(peer->peer_addr));
-                        ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to confirmation message waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        queue.id = WAIT_RESPONSE;
-                        queue.time = esp_timer_get_time() / 1000;
-                        if (xQueueSend(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+                        if (_recv_notify(&queue) != true)
                         {
-                            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+                            break;
+                        }
+                        HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        if (queue.data.delivery_mode == ZH_NETWORK_DELIVERY_CONFIRMED)
+                        {
+                            _ack_add(&queue.data);
                         }
+                        break;
                     }
-                }
-                else
-                {
-                    if (queue.data.message_type == BROADCAST)
+                    if (queue.data.hop_count >= _init_config.max_hops)
                     {
-                        ESP_LOGI(TAG, "Broadcast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        HOT_LOGW(TAG, "ESP-NOW message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X reached the hop limit and was discarded.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        TRACE(TRACE_DROP_HOPS, &queue.data);
+                        break;
                     }
-                    if (queue.data.message_type == SEARCH_REQUEST)
+                    HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for forwarding.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    queue.id = TO_SEND;
+                    if (_queue_push(&queue) == true)
                     {
-                        ESP_LOGI(TAG, "System message for routing request from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        _stats_inc_type(_stats.forwarded, queue.data.message_type);
                     }
-                    if (queue.data.message_type == SEARCH_RESPONSE)
+                    break;
+                case DELIVERY_CONFIRM:
+                    HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    if (memcmp(queue.data.original_target_mac, _self_mac, 6) == 0)
                     {
-                        ESP_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        _pending_confirm_received(&queue.data);
+                        HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        break;
                     }
-                    if (queue.data.message_type == DELIVERY_CONFIRM)
+                    if (queue.data.hop_count >= _init_config.max_hops)
                     {
-                        ESP_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac), MAC2STR(peer->peer_addr));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        HOT_LOGW(TAG, "ESP-NOW message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X reached the hop limit and was discarded.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        TRACE(TRACE_DROP_HOPS, &queue.data);
+                        break;
                     }
-                    if (queue.data.message_type == UNICAST)
+                    HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X fto MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for forwarding.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    queue.id = TO_SEND;
+                    if (_queue_push(&queue) == true)
                     {
-                        ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac), MAC2STR(peer->peer_addr));
-                        ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        _stats_inc_type(_stats.forwarded, queue.data.message_type);
                     }
-                }
-            }
-            else
-            {
-                if (_attempts < _init_config.attempts)
-                {
-                    goto SEND;
-                }
-                _attempts = 0;
-                if (memcmp(queue.data.original_target_mac, _broadcast_mac, 6) != 0)
-                {
-                    ESP_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X is incorrect.", MAC2STR(queue.data.original_target_mac), MAC2STR(peer->peer_addr));
-                    for (uint16_t i = 0; i < zh_vector_get_size(&_route_vector); ++i)
+                    break;
+                case FRAGMENT:
+                case FRAGMENT_CONFIRM:
+                    HOT_LOGI(TAG, "Fragmented message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    if (memcmp(queue.data.original_target_mac, _self_mac, 6) == 0)
                     {
-                        _routing_table_t *routing_table = zh_vector_get_item(&_route_vector, i);
-                        if (memcmp(queue.data.original_target_mac, routing_table->original_target_mac, 6) == 0)
+                        if (queue.data.message_type == FRAGMENT)
+                        {
+                            _fragment_recv(&queue.data);
+                        }
+                        else
                         {
-                            zh_vector_delete_item(&_route_vector, i);
+                            _fragment_confirm_received(&queue.data);
                         }
+                        HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        break;
                     }
-                    if (queue.data.message_type == UNICAST)
+                    if (queue.data.hop_count >= _init_config.max_hops)
                     {
-                        ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        HOT_LOGW(TAG, "ESP-NOW message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X reached the hop limit and was discarded.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        TRACE(TRACE_DROP_HOPS, &queue.data);
+                        break;
                     }
-                    if (queue.data.message_type == DELIVERY_CONFIRM)
+                    HOT_LOGI(TAG, "Fragmented message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for forwarding.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    queue.id = TO_SEND;
+                    if (_queue_push(&queue) == true)
                     {
-                        ESP_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        _stats_inc_type(_stats.forwarded, queue.data.message_type);
                     }
-                    queue.id = WAIT_ROUTE;
-                    queue.time = esp_timer_get_time() / 1000;
-                    if (xQueueSend(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+                    break;
+                case SEARCH_REQUEST:
+                    HOT_LOGI(TAG, "System message for routing request from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    _route_update(queue.data.original_sender_mac, queue.data.sender_mac, queue.data.hop_count, _link_add_path_cost(&queue.data), queue.data.message_id);
+                    if (queue.is_repeat == true)
                     {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    }
-                    ESP_LOGI(TAG, "System message for routing request to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue.", MAC2STR(queue.data.original_target_mac));
-                    queue.id = TO_SEND;
-                    queue.data.message_type = SEARCH_REQUEST;
-                    memcpy(queue.data.original_sender_mac, _self_mac, 6);
-                    queue.data.payload_len = 0;
-                    memset(queue.data.payload, 0, ZH_NETWORK_MAX_MESSAGE_SIZE);
-                    queue.data.message_id = abs(esp_random()); // It is not clear why esp_random() sometimes gives negative values.
-                    ESP_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
-                    {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    }
-                }
-            }
-            esp_now_del_peer(peer->peer_addr);
-            heap_caps_free(on_send);
-            heap_caps_free(peer);
-            break;
-        case ON_RECV:
-            ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processing begin.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-            switch (queue.data.message_type)
-            {
-            case BROADCAST:
-                ESP_LOGI(TAG, "Broadcast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                zh_network_event_on_recv_t *on_recv = heap_caps_malloc(sizeof(zh_network_event_on_recv_t), MALLOC_CAP_8BIT);
-                if (on_recv == NULL)
-                {
-                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    heap_caps_free(on_recv);
-                    break;
-                }
-                memset(on_recv, 0, sizeof(zh_network_event_on_recv_t));
-                memcpy(on_recv->mac_addr, queue.data.original_sender_mac, 6);
-                on_recv->data_len = queue.data.payload_len;
-                on_recv->data = heap_caps_malloc(queue.data.payload_len, MALLOC_CAP_8BIT);
-                if (on_recv->data == NULL)
-                {
-                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    heap_caps_free(on_recv);
-                    heap_caps_free(on_recv->data);
-                    break;
-                }
-                memset(on_recv->data, 0, queue.data.payload_len);
-                memcpy(on_recv->data, queue.data.payload, queue.data.payload_len);
-                ESP_LOGI(TAG, "Broadcast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for resend to all nodes.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_RECV_EVENT, on_recv, sizeof(zh_network_event_on_recv_t) + on_recv->data_len + sizeof(on_recv->data_len), portTICK_PERIOD_MS) != ESP_OK)
-                {
-                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                }
-                heap_caps_free(on_recv);
-                queue.id = TO_SEND;
-                if (xQueueSend(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
-                {
-                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                }
-                break;
-            case UNICAST:
-                ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                if (memcmp(queue.data.original_target_mac, _self_mac, 6) == 0)
-                {
-                    zh_network_event_on_recv_t *on_recv = heap_caps_malloc(sizeof(zh_network_event_on_recv_t), MALLOC_CAP_8BIT);
-                    if (on_recv == NULL)
-                    {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                        heap_caps_free(on_recv);
                         break;
                     }
-                    memset(on_recv, 0, sizeof(zh_network_event_on_recv_t));
-                    memcpy(on_recv->mac_addr, queue.data.original_sender_mac, 6);
-                    on_recv->data_len = queue.data.payload_len;
-                    on_recv->data = heap_caps_malloc(queue.data.payload_len, MALLOC_CAP_8BIT);
-                    if (on_recv->data == NULL)
+                    _pending_route_found(queue.data.original_sender_mac);
+                    if (memcmp(queue.data.original_target_mac, _self_mac, 6) == 0)
                     {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                        heap_caps_free(on_recv);
-                        heap_caps_free(on_recv->data);
+                        HOT_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to the queue.", MAC2STR(queue.data.original_target_mac), MAC2STR(queue.data.original_sender_mac));
+                        queue.id = TO_SEND;
+                        queue.data.message_type = SEARCH_RESPONSE;
+                        memcpy(queue.data.original_target_mac, queue.data.original_sender_mac, 6);
+                        memcpy(queue.data.original_sender_mac, _self_mac, 6);
+                        _link_set_path_cost(&queue.data, 0);
+                        queue.data.message_id = _get_message_id();
+                        queue.data.hop_count = 0;
+                        HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        _queue_push(&queue);
                         break;
                     }
-                    memset(on_recv->data, 0, queue.data.payload_len);
-                    memcpy(on_recv->data, queue.data.payload, queue.data.payload_len);
-                    ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_RECV_EVENT, on_recv, sizeof(zh_network_event_on_recv_t) + on_recv->data_len + sizeof(on_recv->data_len), portTICK_PERIOD_MS) != ESP_OK)
-                    {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    }
-                    heap_caps_free(on_recv);
-                    queue.id = TO_SEND;
-                    queue.data.message_type = DELIVERY_CONFIRM;
-                    memcpy(queue.data.original_target_mac, queue.data.original_sender_mac, 6);
-                    memcpy(queue.data.original_sender_mac, _self_mac, 6);
-                    queue.data.payload_len = 0;
-                    memset(queue.data.payload, 0, ZH_NETWORK_MAX_MESSAGE_SIZE);
-                    queue.data.confirm_id = queue.data.message_id;
-                    queue.data.message_id = abs(esp_random()); // It is not clear why esp_random() sometimes gives negative values.
-                    if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
-                    {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    }
-                    break;
-                }
-                ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for forwarding.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                queue.id = TO_SEND;
-                if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
-                {
-                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                }
-                break;
-            case DELIVERY_CONFIRM:
-                ESP_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                if (memcmp(queue.data.original_target_mac, _self_mac, 6) == 0)
-                {
-                    zh_vector_push_back(&_response_vector, &queue.data.confirm_id);
-                    if (zh_vector_get_size(&_response_vector) > _init_config.queue_size)
-                    {
-                        zh_vector_delete_item(&_response_vector, 0);
-                    }
-                    ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    HOT_LOGI(TAG, "System message for routing request to MAC %02X:%02X:%02X:%02X:%02X:%02X from MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for resend to all nodes.", MAC2STR(queue.data.original_target_mac), MAC2STR(queue.data.original_sender_mac));
+                    HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    _flood_forward(&queue);
                     break;
-                }
-                ESP_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X fto MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for forwarding.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                queue.id = TO_SEND;
-                if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
-                {
-                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                }
-                break;
-            case SEARCH_REQUEST:
-                ESP_LOGI(TAG, "System message for routing request from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                for (uint16_t i = 0; i < zh_vector_get_size(&_route_vector); ++i)
-                {
-                    _routing_table_t *routing_table = zh_vector_get_item(&_route_vector, i);
-                    if (memcmp(queue.data.original_target_mac, routing_table->original_target_mac, 6) == 0)
+                case SEARCH_RESPONSE:
+                    HOT_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                    _route_update(queue.data.original_sender_mac, queue.data.sender_mac, queue.data.hop_count, _link_add_path_cost(&queue.data), queue.data.message_id);
+                    if (queue.is_repeat == true)
                     {
-                        zh_vector_delete_item(&_route_vector, i);
+                        break;
                     }
-                }
-                { // Just to avoid the compiler warning.
-                    _routing_table_t routing_table = {0};
-                    memcpy(routing_table.original_target_mac, queue.data.original_sender_mac, 6);
-                    memcpy(routing_table.intermediate_target_mac, queue.data.sender_mac, 6);
-                    zh_vector_push_back(&_route_vector, &routing_table);
-                }
-                if (zh_vector_get_size(&_route_vector) > _init_config.route_vector_size)
-                {
-                    zh_vector_delete_item(&_route_vector, 0);
-                }
-                if (memcmp(queue.data.original_target_mac, _self_mac, 6) == 0)
-                {
-                    ESP_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to the queue.", MAC2STR(queue.data.original_target_mac), MAC2STR(queue.data.original_sender_mac));
-                    queue.id = TO_SEND;
-                    queue.data.message_type = SEARCH_RESPONSE;
-                    memcpy(queue.data.original_target_mac, queue.data.original_sender_mac, 6);
-                    memcpy(queue.data.original_sender_mac, _self_mac, 6);
-                    queue.data.payload_len = 0;
-                    memset(queue.data.payload, 0, ZH_NETWORK_MAX_MESSAGE_SIZE);
-                    queue.data.message_id = abs(esp_random()); // It is not clear why esp_random() sometimes gives negative values.
-                    ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+                    _pending_route_found(queue.data.original_sender_mac);
+                    if (memcmp(queue.data.original_target_mac, _self_mac, 6) != 0)
                     {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+                        HOT_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for resend to all nodes.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+                        _flood_forward(&queue);
+                        break;
                     }
+                    HOT_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
                     break;
-                }
-                ESP_LOGI(TAG, "System message for routing request to MAC %02X:%02X:%02X:%02X:%02X:%02X from MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for resend to all nodes.", MAC2STR(queue.data.original_target_mac), MAC2STR(queue.data.original_sender_mac));
-                ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                queue.id = TO_SEND;
-                if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
-                {
-                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                }
-                break;
-            case SEARCH_RESPONSE:
-                ESP_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                for (uint16_t i = 0; i < zh_vector_get_size(&_route_vector); ++i)
-                {
-                    _routing_table_t *routing_table = zh_vector_get_item(&_route_vector, i);
-                    if (memcmp(queue.data.original_target_mac, routing_table->original_target_mac, 6) == 0)
-                    {
-                        zh_vector_delete_item(&_route_vector, i);
-                    }
-                }
-                { // Just to avoid the compiler warning.
-                    _routing_table_t routing_table = {0};
-                    memcpy(routing_table.original_target_mac, queue.data.original_sender_mac, 6);
-                    memcpy(routing_table.intermediate_target_mac, queue.data.sender_mac, 6);
-                    zh_vector_push_back(&_route_vector, &routing_table);
-                }
-                if (zh_vector_get_size(&_route_vector) > _init_config.route_vector_size)
-                {
-                    zh_vector_delete_item(&_route_vector, 0);
-                }
-                if (memcmp(queue.data.original_target_mac, _self_mac, 6) != 0)
-                {
-                    ESP_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue for resend to all nodes.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    queue.id = TO_SEND;
-                    if (xQueueSendToFront(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
-                    {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    }
+                default:
                     break;
                 }
-                ESP_LOGI(TAG, "Incoming ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
                 break;
             default:
                 break;
             }
-            break;
-        case WAIT_RESPONSE:
-            for (uint16_t i = 0; i < zh_vector_get_size(&_response_vector); ++i)
+        }
+        _queue_watermark_check();
+    }
+    vTaskDelete(NULL);
+}
+
+static bool _recv_notify(const _queue_t *queue)
+{
+    const _message_t *message = &queue->data;
+    TRACE(TRACE_DELIVER, message);
+    zh_network_recv_cb_t on_recv_cb = _on_recv_cb;
+    if (on_recv_cb != NULL)
+    {
+        on_recv_cb(message->original_sender_mac, message->payload, message->payload_len);
+        LATENCY_ADD(ZH_NETWORK_LATENCY_DELIVER, queue);
+        return true;
+    }
+    zh_network_event_on_recv_t on_recv = {0};
+    memcpy(on_recv.mac_addr, message->original_sender_mac, 6);
+    on_recv.data_len = message->payload_len;
+    on_recv.data = _data_pool_alloc(message->payload_len);
+    if (on_recv.data == NULL)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+        return false;
+    }
+    memcpy(on_recv.data, message->payload, message->payload_len);
+    if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_RECV_EVENT, &on_recv, sizeof(zh_network_event_on_recv_t), portTICK_PERIOD_MS) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+        zh_network_free_data(on_recv.data);
+    }
+    LATENCY_ADD(ZH_NETWORK_LATENCY_DELIVER, queue);
+    return true;
+}
+
+static bool _send_notify(const zh_network_event_on_send_t *on_send)
+{
+    ENTER_CRITICAL();
+    zh_network_send_cb_t on_send_cb = _on_send_cb;
+    void *on_send_cb_arg = _on_send_cb_arg;
+    EXIT_CRITICAL();
+    if (on_send_cb != NULL)
+    {
+        on_send_cb(on_send, on_send_cb_arg);
+        return true;
+    }
+    return esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_SEND_EVENT, on_send, sizeof(zh_network_event_on_send_t), portTICK_PERIOD_MS) == ESP_OK;
+}
+
+static void _stats_inc(uint32_t *counter)
+{
+    ENTER_CRITICAL();
+    ++*counter;
+    EXIT_CRITICAL();
+}
+
+static void _stats_inc_type(uint32_t *counters, const uint8_t message_type)
+{
+    if (message_type < ZH_NETWORK_MESSAGE_TYPE_MAX)
+    {
+        _stats_inc(&counters[message_type]);
+    }
+}
+
+static void _stats_high_water(uint32_t *high_water, QueueHandle_t queue_handle, const uint8_t queue_size)
+{
+    uint32_t used = queue_size - uxQueueSpacesAvailable(queue_handle);
+    ENTER_CRITICAL();
+    if (used > *high_water)
+    {
+        *high_water = used;
+    }
+    EXIT_CRITICAL();
+}
+
+static uint8_t *_data_pool_alloc(const uint8_t data_len)
+{
+    if (_init_config.data_pool_size != 0)
+    {
+        ENTER_CRITICAL();
+        if (_data_pool_free_count != 0)
+        {
+            uint8_t *data = &_data_pool[_data_pool_free[--_data_pool_free_count] * ZH_NETWORK_MAX_MESSAGE_SIZE];
+            EXIT_CRITICAL();
+            return data;
+        }
+        ++_stats.data_pool_exhausted;
+        EXIT_CRITICAL();
+    }
+    return heap_caps_malloc(data_len, MALLOC_CAP_8BIT);
+}
+
+static bool _peer_add(const uint8_t *mac_addr)
+{
+    _peer_t *peer_cache = NULL;
+    for (uint8_t i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; ++i)
+    {
+        _peer_t *item = &_peer_cache[i];
+        if (item->is_used == true && memcmp(item->mac_addr, mac_addr, 6) == 0)
+        {
+            item->time = esp_timer_get_time() / 1000;
+            return true;
+        }
+        if (item->is_used == false)
+        {
+            if (peer_cache == NULL || peer_cache->is_used == true)
             {
-                uint32_t *message_id = zh_vector_get_item(&_response_vector, i);
-                if (memcmp(&queue.data.message_id, message_id, sizeof(queue.data.message_id)) == 0)
-                {
-                    zh_vector_delete_item(&_response_vector, i);
-                    zh_network_event_on_send_t *on_send = heap_caps_malloc(sizeof(zh_network_event_on_send_t), MALLOC_CAP_8BIT);
-                    if (on_send == NULL)
-                    {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                        heap_caps_free(on_send);
-                        break;
-                    }
-                    memset(on_send, 0, sizeof(zh_network_event_on_send_t));
-                    memcpy(on_send->mac_addr, queue.data.original_target_mac, 6);
-                    on_send->status = ZH_NETWORK_SEND_SUCCESS;
-                    ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from confirmation message waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_SEND_EVENT, on_send, sizeof(zh_network_event_on_send_t), portTICK_PERIOD_MS) != ESP_OK)
-                    {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    }
-                    heap_caps_free(on_send);
-                    flag = true;
-                    break;
-                }
+                peer_cache = item;
             }
-            if (flag == false)
+            continue;
+        }
+        if (memcmp(item->mac_addr, _broadcast_mac, 6) == 0 || _peer_is_in_use(item->mac_addr) == true)
+        {
+            continue;
+        }
+        if (peer_cache == NULL || (peer_cache->is_used == true && item->time < peer_cache->time))
+        {
+            peer_cache = item;
+        }
+    }
+    if (peer_cache == NULL)
+    {
+        return false;
+    }
+    if (peer_cache->is_used == true)
+    {
+        esp_now_del_peer(peer_cache->mac_addr);
+        peer_cache->is_used = false;
+    }
+    esp_now_peer_info_t peer = {0};
+    peer.ifidx = _init_config.wifi_interface;
+    memcpy(peer.peer_addr, mac_addr, 6);
+    esp_err_t err = esp_now_add_peer(&peer);
+    if (err != ESP_OK && err != ESP_ERR_ESPNOW_EXIST)
+    {
+        return false;
+    }
+    memcpy(peer_cache->mac_addr, mac_addr, 6);
+    peer_cache->time = esp_timer_get_time() / 1000;
+    peer_cache->is_used = true;
+    return true;
+}
+
+static bool _peer_is_in_use(const uint8_t *mac_addr)
+{
+    for (uint8_t i = 0; i < _init_config.send_window; ++i)
+    {
+        if (_inflight_table[i].is_used == true && memcmp(_inflight_table[i].peer_addr, mac_addr, 6) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _peer_sync(void)
+{
+    for (uint8_t i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; ++i)
+    {
+        _peer_t *peer_cache = &_peer_cache[i];
+        if (peer_cache->is_used == false || memcmp(peer_cache->mac_addr, _broadcast_mac, 6) == 0 || _peer_is_in_use(peer_cache->mac_addr) == true)
+        {
+            continue;
+        }
+        bool flag = false;
+        for (uint16_t j = 0; j < _init_config.route_vector_size; ++j)
+        {
+            if (_route_table[j].is_used == true && memcmp(_route_table[j].intermediate_target_mac, peer_cache->mac_addr, 6) == 0)
             {
-                if ((esp_timer_get_time() / 1000 - queue.time) > _init_config.max_waiting_time)
-                {
-                    ESP_LOGW(TAG, "Time for waiting confirmation message from MAC %02X:%02X:%02X:%02X:%02X:%02X is expired.", MAC2STR(queue.data.original_target_mac));
-                    if (memcmp(queue.data.original_sender_mac, _self_mac, 6) == 0)
-                    {
-                        zh_network_event_on_send_t *on_send = heap_caps_malloc(sizeof(zh_network_event_on_send_t), MALLOC_CAP_8BIT);
-                        if (on_send == NULL)
-                        {
-                            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                            heap_caps_free(on_send);
-                            break;
-                        }
-                        memset(on_send, 0, sizeof(zh_network_event_on_send_t));
-                        memcpy(on_send->mac_addr, queue.data.original_target_mac, 6);
-                        on_send->status = ZH_NETWORK_SEND_FAIL;
-                        ESP_LOGE(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent fail.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from confirmation message waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_SEND_EVENT, on_send, sizeof(zh_network_event_on_send_t), portTICK_PERIOD_MS) != ESP_OK)
-                        {
-                            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                        }
-                        heap_caps_free(on_send);
-                    }
-                    break;
-                }
-                if (xQueueSend(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+                flag = true;
+                break;
+            }
+        }
+        if (flag == false)
+        {
+            esp_now_del_peer(peer_cache->mac_addr);
+            peer_cache->is_used = false;
+        }
+    }
+}
+
+static _inflight_t *_inflight_get_free(void)
+{
+    for (uint8_t i = 0; i < _init_config.send_window; ++i)
+    {
+        if (_inflight_table[i].is_used == false)
+        {
+            return &_inflight_table[i];
+        }
+    }
+    return NULL;
+}
+
+static void _inflight_send(_inflight_t *inflight)
+{
+    ++inflight->attempts;
+    inflight->time = esp_timer_get_time() / 1000;
+    inflight->sequence = _inflight_sequence++;
+    inflight->is_deferred = false;
+    inflight->is_used = true;
+    TRACE(TRACE_SEND, &inflight->queue.data);
+    LATENCY_STAMP(&inflight->queue);
+    esp_err_t err = ESP_OK;
+    if (inflight->frame_len != 0)
+    {
+        err = esp_now_send(inflight->peer_addr, inflight->frame, inflight->frame_len);
+    }
+    else if (_compact_is_allowed(&inflight->queue.data, inflight->peer_addr) == true)
+    {
+        uint8_t frame[sizeof(_compact_message_t)] = {0};
+        err = esp_now_send(inflight->peer_addr, frame, _compact_encode(&inflight->queue.data, frame));
+    }
+    else
+    {
+        err = esp_now_send(inflight->peer_addr, (uint8_t *)&inflight->queue.data, MESSAGE_HEADER_SIZE + inflight->queue.data.payload_len);
+    }
+    if (err == ESP_ERR_ESPNOW_NO_MEM) // Back pressure of the driver. The frame is sent again later and the attempt is not counted.
+    {
+        HOT_LOGW(TAG, "Sending ESP-NOW data to MAC %02X:%02X:%02X:%02X:%02X:%02X deferred. ESP-NOW driver buffer is full.", MAC2STR(inflight->peer_addr));
+        --inflight->attempts;
+        inflight->is_deferred = true;
+        return;
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+        _inflight_complete(inflight, false);
+    }
+}
+
+static void _inflight_complete(_inflight_t *inflight, const bool is_success)
+{
+    LATENCY_ADD(ZH_NETWORK_LATENCY_RADIO, &inflight->queue);
+    if (is_success == false)
+    {
+        _stats_inc(&_stats.send_fail);
+    }
+    if (is_success == false && inflight->attempts < _init_config.attempts && (inflight->queue.data.message_type != UNICAST || inflight->queue.data.delivery_mode != ZH_NETWORK_DELIVERY_NONE))
+    {
+        _stats_inc(&_stats.send_retries);
+        _inflight_send(inflight);
+        return;
+    }
+    TRACE((is_success == true) ? TRACE_SEND_SUCCESS : TRACE_SEND_FAIL, &inflight->queue.data);
+    _queue_t queue = inflight->queue;
+    uint8_t peer_addr[6] = {0};
+    memcpy(peer_addr, inflight->peer_addr, 6);
+    inflight->is_used = false;
+    if (queue.data.message_type != AGGREGATE)
+    {
+        _send_complete(&queue, peer_addr, is_success);
+        return;
+    }
+    if (is_success == true)
+    {
+        _stats_inc_type(_stats.sent, AGGREGATE);
+    }
+    if (inflight->frame_len != 0)
+    {
+        _aggregate_complete(&queue, peer_addr, &inflight->frame[MESSAGE_HEADER_SIZE], inflight->frame_len - MESSAGE_HEADER_SIZE, is_success);
+        return;
+    }
+    _aggregate_complete(&queue, peer_addr, queue.data.payload, queue.data.payload_len, is_success);
+}
+
+static void _send_complete(_queue_t *queue, const uint8_t *peer_addr, const bool is_success)
+{
+    if (is_success == true)
+    {
+        _stats_inc_type(_stats.sent, queue->data.message_type);
+    }
+    if (is_success == true)
+    {
+        zh_network_event_on_send_t on_send = {0};
+        memcpy(on_send.mac_addr, queue->data.original_target_mac, 6);
+        on_send.message_id = queue->send_id;
+        if (memcmp(queue->data.original_sender_mac, _self_mac, 6) == 0)
+        {
+            if (queue->data.message_type == BROADCAST || queue->data.message_type == MULTICAST)
+            {
+                HOT_LOGI(TAG, "%s message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", (queue->data.message_type == BROADCAST) ? "Broadcast" : "Multicast", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                on_send.status = ZH_NETWORK_SEND_SUCCESS;
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                if (_send_notify(&on_send) != true)
                 {
                     ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
                 }
             }
-            break;
-        case WAIT_ROUTE:
-            for (uint16_t i = 0; i < zh_vector_get_size(&_route_vector); ++i)
+            if (queue->data.message_type == SEARCH_REQUEST)
             {
-                _routing_table_t *routing_table = zh_vector_get_item(&_route_vector, i);
-                if (memcmp(queue.data.original_target_mac, routing_table->original_target_mac, 6) == 0)
-                {
-                    ESP_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(queue.data.original_target_mac));
-                    if (queue.data.message_type == UNICAST)
-                    {
-                        ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list and added to queue.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    }
-                    if (queue.data.message_type == DELIVERY_CONFIRM)
-                    {
-                        ESP_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list and added to queue.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                    }
-                    queue.id = TO_SEND;
-                    if (xQueueSend(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
-                    {
-                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                    }
-                    flag = true;
-                    break;
-                }
+                HOT_LOGI(TAG, "System message for routing request from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+            if (queue->data.message_type == SEARCH_RESPONSE)
+            {
+                HOT_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
             }
-            if (flag == false)
+            if (queue->data.message_type == DELIVERY_CONFIRM)
             {
-                if ((esp_timer_get_time() / 1000 - queue.time) > _init_config.max_waiting_time)
+                HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac), MAC2STR(peer_addr));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+            if (queue->data.message_type == UNICAST)
+            {
+                HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac), MAC2STR(peer_addr));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                if (queue->data.delivery_mode == ZH_NETWORK_DELIVERY_NONE)
                 {
-                    ESP_LOGW(TAG, "Time for waiting routing to MAC %02X:%02X:%02X:%02X:%02X:%02X is expired.", MAC2STR(queue.data.original_target_mac));
-                    if (memcmp(queue.data.original_sender_mac, _self_mac, 6) == 0)
-                    {
-                        zh_network_event_on_send_t *on_send = heap_caps_malloc(sizeof(zh_network_event_on_send_t), MALLOC_CAP_8BIT);
-                        if (on_send == NULL)
-                        {
-                            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                            heap_caps_free(on_send);
-                            break;
-                        }
-                        memset(on_send, 0, sizeof(zh_network_event_on_send_t));
-                        memcpy(on_send->mac_addr, queue.data.original_target_mac, 6);
-                        on_send->status = ZH_NETWORK_SEND_FAIL;
-                        ESP_LOGE(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent fail.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_SEND_EVENT, on_send, sizeof(zh_network_event_on_send_t), portTICK_PERIOD_MS) != ESP_OK)
-                        {
-                            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
-                        }
-                        heap_caps_free(on_send);
-                    }
-                    else
+                    return;
+                }
+                if (queue->data.delivery_mode == ZH_NETWORK_DELIVERY_HOP)
+                {
+                    on_send.status = ZH_NETWORK_SEND_SUCCESS;
+                    if (_send_notify(&on_send) != true)
                     {
-                        if (queue.data.message_type == UNICAST)
-                        {
-                            ESP_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        }
-                        if (queue.data.message_type == DELIVERY_CONFIRM)
-                        {
-                            ESP_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
-                        }
+                        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
                     }
-                    break;
+                    return;
                 }
-                if (xQueueSend(_queue_handle, &queue, portTICK_PERIOD_MS) != pdTRUE)
+                HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to confirmation message waiting list.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                queue->id = WAIT_RESPONSE;
+                queue->time = esp_timer_get_time() / 1000;
+                if (_pending_add(queue) != true)
                 {
-                    ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+                    _pending_add_fail(queue);
                 }
             }
+        }
+        else
+        {
+            if (queue->data.message_type == BROADCAST || queue->data.message_type == MULTICAST)
+            {
+                HOT_LOGI(TAG, "%s message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", (queue->data.message_type == BROADCAST) ? "Broadcast" : "Multicast", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+            if (queue->data.message_type == SEARCH_REQUEST)
+            {
+                HOT_LOGI(TAG, "System message for routing request from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+            if (queue->data.message_type == SEARCH_RESPONSE)
+            {
+                HOT_LOGI(TAG, "System message for routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+            if (queue->data.message_type == DELIVERY_CONFIRM)
+            {
+                HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac), MAC2STR(peer_addr));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+            if (queue->data.message_type == UNICAST)
+            {
+                HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac), MAC2STR(peer_addr));
+                HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X processed success.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+        }
+    }
+    else
+    {
+        if (memcmp(queue->data.original_target_mac, _broadcast_mac, 6) != 0 && queue->data.message_type != MULTICAST)
+        {
+            if (queue->data.delivery_mode == ZH_NETWORK_DELIVERY_NONE) // One lost best effort message does not delete the route. The link cost is still updated.
+            {
+                HOT_LOGW(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent fail and was discarded.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+                return;
+            }
+            HOT_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X is incorrect.", MAC2STR(queue->data.original_target_mac), MAC2STR(peer_addr));
+            _route_delete(queue->data.original_target_mac);
+            if (queue->data.message_type == UNICAST)
+            {
+                HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to routing waiting list.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+            if (queue->data.message_type == DELIVERY_CONFIRM)
+            {
+                HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to routing waiting list.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+            }
+            queue->id = WAIT_ROUTE;
+            queue->time = esp_timer_get_time() / 1000;
+            if (_pending_add(queue) != true)
+            {
+                _pending_add_fail(queue);
+                return;
+            }
+            _discovery_start(queue->data.original_target_mac);
+        }
+    }
+}
+
+static void _inflight_result(const uint8_t *mac_addr, const bool is_success)
+{
+    if (memcmp(mac_addr, _broadcast_mac, 6) != 0)
+    {
+        _link_send_result(mac_addr, is_success);
+    }
+    _inflight_t *inflight = NULL;
+    for (uint8_t i = 0; i < _init_config.send_window; ++i)
+    {
+        _inflight_t *item = &_inflight_table[i];
+        if (item->is_used == true && item->is_deferred == false && memcmp(item->peer_addr, mac_addr, 6) == 0 && (inflight == NULL || (int32_t)(item->sequence - inflight->sequence) < 0))
+        {
+            inflight = item;
+        }
+    }
+    if (inflight != NULL)
+    {
+        _inflight_complete(inflight, is_success);
+    }
+}
+
+static void _inflight_check_timeouts(void)
+{
+    uint64_t time = esp_timer_get_time() / 1000;
+    for (uint8_t i = 0; i < _init_config.send_window; ++i)
+    {
+        if (_inflight_table[i].is_used == true && _inflight_table[i].is_deferred == true)
+        {
+            if ((time - _inflight_table[i].time) >= SEND_DEFER_TIME)
+            {
+                _inflight_send(&_inflight_table[i]);
+            }
+            continue;
+        }
+        if (_inflight_table[i].is_used == true && (time - _inflight_table[i].time) > MAX_SEND_RESULT_WAITING_TIME)
+        {
+            HOT_LOGW(TAG, "Time for waiting send result to MAC %02X:%02X:%02X:%02X:%02X:%02X is expired.", MAC2STR(_inflight_table[i].peer_addr));
+            _inflight_complete(&_inflight_table[i], false);
+        }
+    }
+}
+
+static uint64_t _inflight_get_deadline(void)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (uint8_t i = 0; i < _init_config.send_window; ++i)
+    {
+        uint64_t item_deadline = _inflight_table[i].time + ((_inflight_table[i].is_deferred == true) ? SEND_DEFER_TIME : MAX_SEND_RESULT_WAITING_TIME);
+        if (_inflight_table[i].is_used == true && item_deadline < deadline)
+        {
+            deadline = item_deadline;
+        }
+    }
+    return deadline;
+}
+
+static bool _pending_add(const _queue_t *queue)
+{
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        _pending_t *pending = &_pending_table[i];
+        if (pending->is_used == false)
+        {
+            pending->queue = *queue;
+            pending->deadline = queue->time + _init_config.max_waiting_time;
+            pending->is_used = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _pending_route_found(const uint8_t *mac_addr)
+{
+    _discovery_stop(mac_addr);
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        _pending_t *pending = &_pending_table[i];
+        if (pending->is_used == false || pending->queue.id != WAIT_ROUTE || memcmp(pending->queue.data.original_target_mac, mac_addr, 6) != 0)
+        {
+            continue;
+        }
+        HOT_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X is received.", MAC2STR(pending->queue.data.original_target_mac));
+        if (pending->queue.data.message_type == UNICAST)
+        {
+            HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list and added to queue.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+        }
+        if (pending->queue.data.message_type == DELIVERY_CONFIRM)
+        {
+            HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list and added to queue.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+        }
+        _pending_resend(pending);
+    }
+}
+
+static void _pending_resend(_pending_t *pending)
+{
+    pending->queue.id = TO_SEND;
+    if (_queue_push(&pending->queue) != true)
+    {
+        pending->queue.id = WAIT_ROUTE; // Stays in the routing waiting list and is added to queue again on the next check until the waiting time is expired.
+        return;
+    }
+    pending->is_used = false;
+}
+
+static void _pending_confirm_received(const _message_t *message)
+{
+    if (message->payload_len != sizeof(_delivery_confirm_t))
+    {
+        HOT_LOGW(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X discarded. Incorrect ESP-NOW data size.", MAC2STR(message->original_sender_mac));
+        _stats_inc(&_stats.size_rejected);
+        return;
+    }
+    _delivery_confirm_t delivery_confirm = {0};
+    memcpy(&delivery_confirm, message->payload, sizeof(delivery_confirm));
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        _pending_t *pending = &_pending_table[i];
+        if (pending->is_used == false || pending->queue.id != WAIT_RESPONSE || memcmp(pending->queue.data.original_target_mac, message->original_sender_mac, 6) != 0)
+        {
+            continue;
+        }
+        uint32_t offset = delivery_confirm.message_id - pending->queue.data.message_id;
+        if (offset >= ID_WINDOW_SIZE || (delivery_confirm.window & (1UL << offset)) == 0)
+        {
+            continue;
+        }
+        _pending_confirm(pending);
+    }
+}
+
+static void _pending_confirm(_pending_t *pending)
+{
+    pending->is_used = false;
+    TRACE(TRACE_CONFIRM, &pending->queue.data);
+    LATENCY_ADD(ZH_NETWORK_LATENCY_CONFIRM, &pending->queue);
+    zh_network_event_on_send_t on_send = {0};
+    memcpy(on_send.mac_addr, pending->queue.data.original_target_mac, 6);
+    on_send.message_id = pending->queue.send_id;
+    on_send.status = ZH_NETWORK_SEND_SUCCESS;
+    HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+    HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from confirmation message waiting list.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+    if (_send_notify(&on_send) != true)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+    }
+}
+
+static void _pending_check_timeouts(void)
+{
+    uint64_t time = esp_timer_get_time() / 1000;
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        _pending_t *pending = &_pending_table[i];
+        if (pending->is_used == true && pending->deadline >= time && pending->queue.id == WAIT_ROUTE && _route_find(pending->queue.data.original_target_mac) != NULL)
+        {
+            _pending_resend(pending); // The routing was received when the queue was full.
+            continue;
+        }
+        if (pending->is_used == false || pending->deadline >= time)
+        {
+            continue;
+        }
+        pending->is_used = false;
+        TRACE(TRACE_TIMEOUT, &pending->queue.data);
+        _stats_inc((pending->queue.id == WAIT_RESPONSE) ? &_stats.response_timeouts : &_stats.route_timeouts);
+        if (pending->queue.id == WAIT_RESPONSE)
+        {
+            HOT_LOGW(TAG, "Time for waiting confirmation message from MAC %02X:%02X:%02X:%02X:%02X:%02X is expired.", MAC2STR(pending->queue.data.original_target_mac));
+        }
+        else
+        {
+            HOT_LOGW(TAG, "Time for waiting routing to MAC %02X:%02X:%02X:%02X:%02X:%02X is expired.", MAC2STR(pending->queue.data.original_target_mac));
+        }
+        if (memcmp(pending->queue.data.original_sender_mac, _self_mac, 6) == 0 && pending->queue.data.message_type != FRAGMENT && pending->queue.data.message_type != FRAGMENT_CONFIRM && pending->queue.data.delivery_mode != ZH_NETWORK_DELIVERY_NONE)
+        {
+            zh_network_event_on_send_t on_send = {0};
+            memcpy(on_send.mac_addr, pending->queue.data.original_target_mac, 6);
+            on_send.message_id = pending->queue.send_id;
+            on_send.status = ZH_NETWORK_SEND_FAIL;
+            ESP_LOGE(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent fail.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+            if (pending->queue.id == WAIT_RESPONSE)
+            {
+                HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from confirmation message waiting list.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+            }
+            else
+            {
+                HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+            }
+            if (_send_notify(&on_send) != true)
+            {
+                ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+            }
+        }
+        else if (pending->queue.id == WAIT_ROUTE)
+        {
+            if (pending->queue.data.message_type == UNICAST)
+            {
+                HOT_LOGI(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+            }
+            if (pending->queue.data.message_type == DELIVERY_CONFIRM)
+            {
+                HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X removed from routing waiting list.", MAC2STR(pending->queue.data.original_sender_mac), MAC2STR(pending->queue.data.original_target_mac));
+            }
+        }
+    }
+}
+
+static uint64_t _pending_get_deadline(void)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        if (_pending_table[i].is_used == true && _pending_table[i].deadline < deadline)
+        {
+            deadline = _pending_table[i].deadline;
+        }
+    }
+    return deadline;
+}
+
+static void _pending_add_fail(const _queue_t *queue)
+{
+    HOT_LOGW(TAG, "ESP-NOW message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X discarded. Waiting list is full.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+    if (memcmp(queue->data.original_sender_mac, _self_mac, 6) != 0 || queue->data.message_type != UNICAST || queue->data.delivery_mode == ZH_NETWORK_DELIVERY_NONE)
+    {
+        return;
+    }
+    zh_network_event_on_send_t on_send = {0};
+    memcpy(on_send.mac_addr, queue->data.original_target_mac, 6);
+    on_send.message_id = queue->send_id;
+    on_send.status = ZH_NETWORK_SEND_FAIL;
+    ESP_LOGE(TAG, "Unicast message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X sent fail.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+    if (_send_notify(&on_send) != true)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+    }
+}
+
+static TickType_t _get_wait_time(void)
+{
+    uint64_t deadline = _pending_get_deadline();
+    uint64_t flood_deadline = _flood_get_deadline();
+    if (flood_deadline < deadline)
+    {
+        deadline = flood_deadline;
+    }
+    uint64_t inflight_deadline = _inflight_get_deadline();
+    if (inflight_deadline < deadline)
+    {
+        deadline = inflight_deadline;
+    }
+    uint64_t discovery_deadline = _discovery_get_deadline();
+    if (discovery_deadline < deadline)
+    {
+        deadline = discovery_deadline;
+    }
+    uint64_t fragment_deadline = _fragment_get_deadline();
+    if (fragment_deadline < deadline)
+    {
+        deadline = fragment_deadline;
+    }
+    uint64_t aggregate_deadline = _aggregate_get_deadline();
+    if (aggregate_deadline < deadline)
+    {
+        deadline = aggregate_deadline;
+    }
+    uint64_t ack_deadline = _ack_get_deadline();
+    if (ack_deadline < deadline)
+    {
+        deadline = ack_deadline;
+    }
+    uint64_t route_save_deadline = _route_save_get_deadline();
+    if (route_save_deadline < deadline)
+    {
+        deadline = route_save_deadline;
+    }
+    if (deadline == UINT64_MAX)
+    {
+        return portMAX_DELAY;
+    }
+    uint64_t time = esp_timer_get_time() / 1000;
+    if (deadline < time)
+    {
+        return 0;
+    }
+    return (deadline - time) / portTICK_PERIOD_MS + 1;
+}
+
+static QueueHandle_t _queue_get_handle(const _queue_t *queue)
+{
+    if (queue->id == ON_RECV)
+    {
+        return _rx_queue_handle;
+    }
+    switch (queue->data.message_type)
+    {
+    case SEARCH_REQUEST:
+    case SEARCH_RESPONSE:
+        return _control_queue_handle;
+    case DELIVERY_CONFIRM:
+    case FRAGMENT_CONFIRM:
+        return _confirm_queue_handle;
+    case AGGREGATE:
+        return _forward_queue_handle;
+    default:
+        break;
+    }
+    if (memcmp(queue->data.original_sender_mac, _self_mac, 6) == 0)
+    {
+        return _queue_handle;
+    }
+    return _forward_queue_handle;
+}
+
+static bool _queue_push(_queue_t *queue)
+{
+    QueueHandle_t queue_handle = _queue_get_handle(queue);
+    if (queue_handle == _forward_queue_handle && _origin_admit(&queue->data) != true)
+    {
+        TRACE(TRACE_DROP_QUEUE, &queue->data);
+        _stats_inc(&_stats.forward_limited);
+        HOT_LOGW(TAG, "ESP-NOW message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X discarded. Forwarding limit of the original sender is exceeded.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+        return false;
+    }
+    LATENCY_STAMP(queue);
+    if (xQueueSend(queue_handle, queue, 0) != pdTRUE)
+    {
+        if (queue_handle == _forward_queue_handle)
+        {
+            _origin_release(&queue->data);
+        }
+        TRACE(TRACE_DROP_QUEUE, &queue->data);
+        _stats_inc(&_stats.internal_queue_full);
+        HOT_LOGW(TAG, "ESP-NOW message from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X discarded. Queue is full.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac));
+        return false;
+    }
+    return true;
+}
+
+static bool _queue_pop(_queue_t *queue, const bool is_recv_first)
+{
+    if (is_recv_first == true && xQueueReceive(_rx_queue_handle, queue, 0) == pdTRUE)
+    {
+        return true;
+    }
+    if (_inflight_get_free() != NULL)
+    {
+        if (xQueueReceive(_control_queue_handle, queue, 0) == pdTRUE || xQueueReceive(_confirm_queue_handle, queue, 0) == pdTRUE)
+        {
+            return true;
+        }
+        if (xQueueReceive(_forward_queue_handle, queue, 0) == pdTRUE)
+        {
+            _origin_release(&queue->data);
+            return true;
+        }
+        if (xQueueReceive(_queue_handle, queue, 0) == pdTRUE)
+        {
+            return true;
+        }
+    }
+    return xQueueReceive(_rx_queue_handle, queue, 0) == pdTRUE;
+}
+
+static void _queue_watermark_check(void)
+{
+    if (_init_config.queue_high_watermark == 0)
+    {
+        return;
+    }
+    zh_network_event_on_queue_t on_queue = {0};
+    on_queue.queue_used = uxQueueMessagesWaiting(_queue_handle);
+    bool is_changed = false;
+    ENTER_CRITICAL();
+    if (_is_queue_high == false && on_queue.queue_used >= _init_config.queue_high_watermark)
+    {
+        _is_queue_high = true;
+        is_changed = true;
+    }
+    else if (_is_queue_high == true && on_queue.queue_used <= _init_config.queue_low_watermark)
+    {
+        _is_queue_high = false;
+        is_changed = true;
+    }
+    on_queue.status = (_is_queue_high == true) ? ZH_NETWORK_QUEUE_HIGH : ZH_NETWORK_QUEUE_LOW;
+    EXIT_CRITICAL();
+    if (is_changed == false)
+    {
+        return;
+    }
+    HOT_LOGI(TAG, "Queue for outgoing messages of the application reached the %s watermark. Used %d of %d.", (on_queue.status == ZH_NETWORK_QUEUE_HIGH) ? "high" : "low", on_queue.queue_used, _init_config.queue_size);
+    if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_QUEUE_EVENT, &on_queue, sizeof(zh_network_event_on_queue_t), portTICK_PERIOD_MS) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+    }
+}
+
+static uint32_t _get_message_id(void)
+{
+    ENTER_CRITICAL();
+    uint32_t message_id = ++_message_id;
+    EXIT_CRITICAL();
+    return message_id;
+}
+
+static uint32_t _mac_hash(const uint8_t *mac_addr)
+{
+    uint32_t hash = 2166136261;
+    for (uint8_t i = 0; i < 6; ++i)
+    {
+        hash ^= mac_addr[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static bool _id_cache_is_repeat(const uint8_t *mac_addr, const uint32_t message_id)
+{
+    uint16_t index = _mac_hash(mac_addr) % _init_config.id_vector_size;
+    _id_cache_t *id_cache = NULL;
+    _id_cache_t *free_item = NULL;
+    for (uint8_t i = 0; i < HASH_PROBE_LIMIT && i < _init_config.id_vector_size; ++i)
+    {
+        _id_cache_t *item = &_id_cache[(index + i) % _init_config.id_vector_size];
+        if (item->is_used == true && memcmp(item->mac_addr, mac_addr, 6) == 0)
+        {
+            id_cache = item;
+            break;
+        }
+        if (free_item == NULL || (free_item->is_used == true && (item->is_used == false || item->time < free_item->time)))
+        {
+            free_item = item;
+        }
+    }
+    uint64_t time = esp_timer_get_time() / 1000;
+    if (id_cache == NULL)
+    {
+        memcpy(free_item->mac_addr, mac_addr, 6);
+        free_item->message_id = message_id;
+        free_item->window = 1;
+        free_item->copies_message_id = message_id;
+        free_item->copies = 1;
+        free_item->time = time;
+        free_item->is_used = true;
+        return false;
+    }
+    uint32_t offset = message_id - id_cache->message_id;
+    if ((int32_t)offset < 0 && -offset >= ID_WINDOW_SIZE && time - id_cache->time < RESTART_IDLE_TIME)
+    {
+        return true; // Late copy of a message behind the window. The node was heard recently, so it was not restarted.
+    }
+    id_cache->time = time;
+    if (id_cache->copies_message_id == message_id && id_cache->copies < UINT8_MAX)
+    {
+        ++id_cache->copies; // Counts every copy. The first one was counted when the message was accepted.
+    }
+    if (offset == 0)
+    {
+        return true;
+    }
+    if ((int32_t)offset > 0)
+    {
+        id_cache->window = (offset < ID_WINDOW_SIZE) ? ((id_cache->window << offset) | 1) : 1;
+        id_cache->message_id = message_id;
+        id_cache->copies_message_id = message_id;
+        id_cache->copies = 1;
+        return false;
+    }
+    offset = -offset;
+    if (offset < ID_WINDOW_SIZE)
+    {
+        if ((id_cache->window & (1UL << offset)) != 0)
+        {
+            return true;
+        }
+        id_cache->window |= (1UL << offset);
+        return false;
+    }
+    id_cache->window = 1; // Far behind the window after a silence. The node was restarted and has a new message ID sequence.
+    id_cache->message_id = message_id;
+    id_cache->copies_message_id = message_id;
+    id_cache->copies = 1;
+    return false;
+}
+
+static uint8_t _id_cache_get_copies(const uint8_t *mac_addr, const uint32_t message_id)
+{
+    uint16_t index = _mac_hash(mac_addr) % _init_config.id_vector_size;
+    for (uint8_t i = 0; i < HASH_PROBE_LIMIT && i < _init_config.id_vector_size; ++i)
+    {
+        _id_cache_t *id_cache = &_id_cache[(index + i) % _init_config.id_vector_size];
+        if (id_cache->is_used == true && memcmp(id_cache->mac_addr, mac_addr, 6) == 0)
+        {
+            return (id_cache->copies_message_id == message_id) ? id_cache->copies : 0; // Read without lock. A stale value only causes one extra or one skipped resend.
+        }
+    }
+    return 0;
+}
+
+static _routing_table_t *_route_find(const uint8_t *mac_addr)
+{
+    uint16_t index = _mac_hash(mac_addr) % _init_config.route_vector_size;
+    for (uint8_t i = 0; i < HASH_PROBE_LIMIT && i < _init_config.route_vector_size; ++i)
+    {
+        _routing_table_t *routing_table = &_route_table[(index + i) % _init_config.route_vector_size];
+        if (routing_table->is_used == false || memcmp(routing_table->original_target_mac, mac_addr, 6) != 0)
+        {
+            continue;
+        }
+        if ((esp_timer_get_time() / 1000 - routing_table->time) > (uint64_t)_init_config.route_lifetime * 1000)
+        {
+            HOT_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X is expired.", MAC2STR(mac_addr));
+            routing_table->is_used = false;
+            _route_is_changed = true;
+            _peer_sync();
+            return NULL;
+        }
+        return routing_table;
+    }
+    return NULL;
+}
+
+static void _route_update(const uint8_t *original_target_mac, const uint8_t *intermediate_target_mac, const uint8_t hop_count, const uint16_t path_cost, const uint32_t message_id)
+{
+    if (memcmp(original_target_mac, _self_mac, 6) == 0)
+    {
+        return;
+    }
+    uint64_t time = esp_timer_get_time() / 1000;
+    _routing_table_t *routing_table = _route_find(original_target_mac);
+    if (routing_table != NULL && routing_table->is_verified == true)
+    {
+        int32_t offset = (int32_t)(message_id - routing_table->message_id);
+        if ((offset < 0 && time - routing_table->time < RESTART_IDLE_TIME) || (offset == 0 && path_cost >= routing_table->path_cost))
+        {
+            return; // The existing route is fresher or not more costly. An older message ID after a silence means the node was restarted.
+        }
+    }
+    else if (routing_table == NULL)
+    {
+        uint16_t index = _mac_hash(original_target_mac) % _init_config.route_vector_size;
+        for (uint8_t i = 0; i < HASH_PROBE_LIMIT && i < _init_config.route_vector_size; ++i)
+        {
+            _routing_table_t *item = &_route_table[(index + i) % _init_config.route_vector_size];
+            if (routing_table == NULL || (routing_table->is_used == true && (item->is_used == false || item->time < routing_table->time)))
+            {
+                routing_table = item;
+            }
+        }
+        if (routing_table->is_used == true)
+        {
+            HOT_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X is replaced by routing to MAC %02X:%02X:%02X:%02X:%02X:%02X.", MAC2STR(routing_table->original_target_mac), MAC2STR(original_target_mac));
+        }
+    }
+    bool is_new_hop = (routing_table->is_used == false || memcmp(routing_table->intermediate_target_mac, intermediate_target_mac, 6) != 0);
+    memcpy(routing_table->original_target_mac, original_target_mac, 6);
+    memcpy(routing_table->intermediate_target_mac, intermediate_target_mac, 6);
+    routing_table->hop_count = hop_count;
+    routing_table->path_cost = path_cost;
+    routing_table->message_id = message_id;
+    routing_table->time = time;
+    routing_table->is_verified = true;
+    routing_table->is_used = true;
+    if (is_new_hop == true)
+    {
+        _route_is_changed = true;
+        _peer_sync();
+    }
+}
+
+static void _route_delete(const uint8_t *mac_addr)
+{
+    _routing_table_t *routing_table = _route_find(mac_addr);
+    if (routing_table != NULL)
+    {
+        routing_table->is_used = false;
+        _route_is_changed = true;
+        _peer_sync();
+    }
+}
+
+static void _route_learn(const _message_t *message)
+{
+    uint16_t path_cost = _link_get_cost(message->sender_mac) + message->hop_count - 1; // The cost of the previous links is unknown. Each of them is counted as one hop.
+    _routing_table_t *routing_table = _route_find(message->original_sender_mac);
+    if (routing_table != NULL && routing_table->path_cost < path_cost && memcmp(routing_table->intermediate_target_mac, message->sender_mac, 6) != 0)
+    {
+        return; // A message received via a more costly path does not replace a route via another node.
+    }
+    bool is_new_route = (routing_table == NULL);
+    _route_update(message->original_sender_mac, message->sender_mac, message->hop_count, path_cost, message->message_id);
+    if (is_new_route == true && _route_find(message->original_sender_mac) != NULL)
+    {
+        HOT_LOGI(TAG, "Routing to MAC %02X:%02X:%02X:%02X:%02X:%02X via MAC %02X:%02X:%02X:%02X:%02X:%02X is learned from received message.", MAC2STR(message->original_sender_mac), MAC2STR(message->sender_mac));
+        _pending_route_found(message->original_sender_mac);
+    }
+}
+
+static void _route_load(void)
+{
+    nvs_handle_t nvs_handle = 0;
+    if (nvs_open(ROUTE_SNAPSHOT_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return;
+    }
+    size_t size = 0;
+    if (nvs_get_blob(nvs_handle, ROUTE_SNAPSHOT_KEY, NULL, &size) != ESP_OK || size < sizeof(uint32_t))
+    {
+        nvs_close(nvs_handle);
+        return;
+    }
+    uint8_t *snapshot = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    if (snapshot == NULL || nvs_get_blob(nvs_handle, ROUTE_SNAPSHOT_KEY, snapshot, &size) != ESP_OK)
+    {
+        nvs_close(nvs_handle);
+        heap_caps_free(snapshot);
+        return;
+    }
+    nvs_close(nvs_handle);
+    uint32_t network_id = 0;
+    memcpy(&network_id, snapshot, sizeof(network_id));
+    uint16_t count = 0;
+    for (size_t offset = sizeof(network_id); network_id == _init_config.network_id && offset + sizeof(_route_snapshot_t) <= size; offset += sizeof(_route_snapshot_t))
+    {
+        _route_snapshot_t route_snapshot = {0};
+        memcpy(&route_snapshot, &snapshot[offset], sizeof(route_snapshot));
+        _route_update(route_snapshot.original_target_mac, route_snapshot.intermediate_target_mac, route_snapshot.hop_count, route_snapshot.hop_count, route_snapshot.message_id);
+        _routing_table_t *routing_table = _route_find(route_snapshot.original_target_mac);
+        if (routing_table != NULL)
+        {
+            routing_table->is_verified = false;
+            ++count;
+        }
+    }
+    heap_caps_free(snapshot);
+    _route_is_changed = false;
+    ESP_LOGI(TAG, "Routing table loaded from NVS. Loaded %d routes.", count);
+}
+
+static void _route_save(void)
+{
+    _route_save_time = esp_timer_get_time() / 1000;
+    _route_is_changed = false;
+    uint8_t *snapshot = heap_caps_malloc(sizeof(uint32_t) + _init_config.route_vector_size * sizeof(_route_snapshot_t), MALLOC_CAP_8BIT);
+    if (snapshot == NULL)
+    {
+        ESP_LOGW(TAG, "Routing table saving to NVS fail. Memory allocation fail or no free memory in the heap.");
+        return;
+    }
+    memcpy(snapshot, &_init_config.network_id, sizeof(uint32_t));
+    size_t size = sizeof(uint32_t);
+    for (uint16_t i = 0; i < _init_config.route_vector_size; ++i)
+    {
+        _routing_table_t *routing_table = &_route_table[i];
+        if (routing_table->is_used == false)
+        {
+            continue;
+        }
+        _route_snapshot_t route_snapshot = {0};
+        memcpy(route_snapshot.original_target_mac, routing_table->original_target_mac, 6);
+        memcpy(route_snapshot.intermediate_target_mac, routing_table->intermediate_target_mac, 6);
+        route_snapshot.hop_count = routing_table->hop_count;
+        route_snapshot.message_id = routing_table->message_id;
+        memcpy(&snapshot[size], &route_snapshot, sizeof(route_snapshot));
+        size += sizeof(route_snapshot);
+    }
+    nvs_handle_t nvs_handle = 0;
+    if (nvs_open(ROUTE_SNAPSHOT_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Routing table saving to NVS fail. NVS not initialized.");
+        heap_caps_free(snapshot);
+        return;
+    }
+    if (nvs_set_blob(nvs_handle, ROUTE_SNAPSHOT_KEY, snapshot, size) != ESP_OK || nvs_commit(nvs_handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Routing table saving to NVS fail. Internal error.");
+    }
+    else
+    {
+        HOT_LOGI(TAG, "Routing table saved to NVS.");
+    }
+    nvs_close(nvs_handle);
+    heap_caps_free(snapshot);
+}
+
+static void _route_save_check(void)
+{
+    if (esp_timer_get_time() / 1000 >= _route_save_get_deadline())
+    {
+        _route_save();
+    }
+}
+
+static uint64_t _route_save_get_deadline(void)
+{
+    if (_init_config.route_save_interval == 0 || _route_is_changed == false)
+    {
+        return UINT64_MAX;
+    }
+    return _route_save_time + (uint64_t)_init_config.route_save_interval * 1000;
+}
+
+static _link_t *_link_get(const uint8_t *mac_addr)
+{
+    uint16_t index = _mac_hash(mac_addr) % _init_config.route_vector_size;
+    _link_t *link = NULL;
+    for (uint8_t i = 0; i < HASH_PROBE_LIMIT && i < _init_config.route_vector_size; ++i)
+    {
+        _link_t *item = &_link_table[(index + i) % _init_config.route_vector_size];
+        if (item->is_used == true && memcmp(item->mac_addr, mac_addr, 6) == 0)
+        {
+            return item;
+        }
+        if (link == NULL || (link->is_used == true && (item->is_used == false || item->time < link->time)))
+        {
+            link = item;
+        }
+    }
+    memcpy(link->mac_addr, mac_addr, 6);
+    link->rssi = 0;
+    link->delivery = UINT8_MAX;
+    link->max_frame = 0;
+    link->time = esp_timer_get_time() / 1000;
+    link->is_used = true;
+    return link;
+}
+
+static void _link_recv(const uint8_t *mac_addr, const int8_t rssi)
+{
+    _link_t *link = _link_get(mac_addr);
+    link->time = esp_timer_get_time() / 1000;
+    if (rssi == 0)
+    {
+        return; // RSSI is not available on this platform.
+    }
+    link->rssi = (link->rssi == 0) ? rssi : (int8_t)(((int16_t)link->rssi * (LINK_SMOOTHING - 1) + rssi) / LINK_SMOOTHING);
+}
+
+static void _link_send_result(const uint8_t *mac_addr, const bool is_success)
+{
+    _link_t *link = _link_get(mac_addr);
+    link->time = esp_timer_get_time() / 1000;
+    link->delivery = ((uint16_t)link->delivery * (LINK_SMOOTHING - 1) + ((is_success == true) ? UINT8_MAX : 0)) / LINK_SMOOTHING;
+}
+
+static uint8_t _link_get_cost(const uint8_t *mac_addr)
+{
+    uint16_t index = _mac_hash(mac_addr) % _init_config.route_vector_size;
+    for (uint8_t i = 0; i < HASH_PROBE_LIMIT && i < _init_config.route_vector_size; ++i)
+    {
+        _link_t *link = &_link_table[(index + i) % _init_config.route_vector_size];
+        if (link->is_used == false || memcmp(link->mac_addr, mac_addr, 6) != 0)
+        {
+            continue;
+        }
+        uint8_t cost = 1 + (UINT8_MAX - link->delivery) / 32; // Each lost eighth of the sent frames costs one more hop.
+        if (link->rssi != 0 && link->rssi < LINK_RSSI_GOOD)
+        {
+            cost += (LINK_RSSI_GOOD - link->rssi) / LINK_RSSI_STEP;
+        }
+        return cost;
+    }
+    return 1;
+}
+
+static uint16_t _link_add_path_cost(_message_t *message)
+{
+    uint16_t path_cost = 0;
+    if (message->payload_len >= sizeof(path_cost))
+    {
+        memcpy(&path_cost, message->payload, sizeof(path_cost));
+    }
+    if (message->payload_len >= sizeof(path_cost) + sizeof(uint16_t)) // Maximum frame size of the previous node. Sent only by devices with ESP-NOW v2 frames.
+    {
+        uint16_t max_frame = 0;
+        memcpy(&max_frame, &message->payload[sizeof(path_cost)], sizeof(max_frame));
+        // Frames above the ESP-NOW v1 limit are usable only if this device also sends ESP-NOW v2 frames. Otherwise the v1 frame size is used.
+        _link_get(message->sender_mac)->max_frame = (MAX_FRAME_SIZE > ESP_NOW_MAX_DATA_LEN && max_frame > ESP_NOW_MAX_DATA_LEN) ? ((max_frame < MAX_FRAME_SIZE) ? max_frame : MAX_FRAME_SIZE) : 0;
+    }
+    uint8_t cost = _link_get_cost(message->sender_mac);
+    path_cost = (path_cost > UINT16_MAX - cost) ? UINT16_MAX : path_cost + cost;
+    _link_set_path_cost(message, path_cost);
+    return path_cost;
+}
+
+static void _link_set_path_cost(_message_t *message, const uint16_t path_cost)
+{
+    memcpy(message->payload, &path_cost, sizeof(path_cost));
+    message->payload_len = sizeof(path_cost);
+    if (MAX_FRAME_SIZE > ESP_NOW_MAX_DATA_LEN)
+    {
+        uint16_t max_frame = MAX_FRAME_SIZE;
+        memcpy(&message->payload[sizeof(path_cost)], &max_frame, sizeof(max_frame));
+        message->payload_len += sizeof(max_frame);
+    }
+}
+
+static void _discovery_start(const uint8_t *mac_addr)
+{
+    _discovery_t *discovery = NULL;
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        _discovery_t *item = &_discovery_table[i];
+        if (item->is_used == true && memcmp(item->mac_addr, mac_addr, 6) == 0)
+        {
+            HOT_LOGI(TAG, "Routing request to MAC %02X:%02X:%02X:%02X:%02X:%02X is already in progress.", MAC2STR(mac_addr));
+            return;
+        }
+        if (item->is_used == false && discovery == NULL)
+        {
+            discovery = item;
+        }
+    }
+    if (discovery == NULL)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+        return;
+    }
+    memcpy(discovery->mac_addr, mac_addr, 6);
+    discovery->attempts = 1;
+    discovery->deadline = esp_timer_get_time() / 1000 + _init_config.discovery_timeout;
+    discovery->is_used = true;
+    _discovery_send(mac_addr);
+}
+
+static void _discovery_send(const uint8_t *mac_addr)
+{
+    _queue_t queue = {0};
+    queue.id = TO_SEND;
+    queue.data.message_type = SEARCH_REQUEST;
+    queue.data.network_id = _init_config.network_id;
+    queue.data.message_id = _get_message_id();
+    memcpy(queue.data.original_target_mac, mac_addr, 6);
+    memcpy(queue.data.original_sender_mac, _self_mac, 6);
+    _link_set_path_cost(&queue.data, 0);
+    HOT_LOGI(TAG, "System message for routing request to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue.", MAC2STR(queue.data.original_target_mac));
+    if (_queue_push(&queue) == true)
+    {
+        _stats_inc(&_stats.route_discoveries);
+    }
+}
+
+static void _discovery_stop(const uint8_t *mac_addr)
+{
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        if (_discovery_table[i].is_used == true && memcmp(_discovery_table[i].mac_addr, mac_addr, 6) == 0)
+        {
+            _discovery_table[i].is_used = false;
+            return;
+        }
+    }
+}
+
+static void _discovery_check_timeouts(void)
+{
+    uint64_t time = esp_timer_get_time() / 1000;
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        _discovery_t *discovery = &_discovery_table[i];
+        if (discovery->is_used == false || discovery->deadline >= time)
+        {
+            continue;
+        }
+        bool flag = false;
+        for (uint16_t j = 0; j < _init_config.queue_size; ++j)
+        {
+            _pending_t *pending = &_pending_table[j];
+            if (pending->is_used == true && pending->queue.id == WAIT_ROUTE && memcmp(pending->queue.data.original_target_mac, discovery->mac_addr, 6) == 0)
+            {
+                flag = true;
+                break;
+            }
+        }
+        if (flag == false)
+        {
+            discovery->is_used = false;
+            continue;
+        }
+        HOT_LOGI(TAG, "Time for waiting routing response from MAC %02X:%02X:%02X:%02X:%02X:%02X is expired. Routing request will be repeated.", MAC2STR(discovery->mac_addr));
+        discovery->deadline = time + ((uint64_t)_init_config.discovery_timeout << discovery->attempts);
+        if (discovery->attempts < 8)
+        {
+            ++discovery->attempts;
+        }
+        _discovery_send(discovery->mac_addr);
+    }
+}
+
+static uint64_t _discovery_get_deadline(void)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (uint16_t i = 0; i < _init_config.queue_size; ++i)
+    {
+        if (_discovery_table[i].is_used == true && _discovery_table[i].deadline < deadline)
+        {
+            deadline = _discovery_table[i].deadline;
+        }
+    }
+    return deadline;
+}
+
+static void _flood_forward(_queue_t *queue)
+{
+    if (queue->data.hop_count >= _init_config.max_hops)
+    {
+        TRACE(TRACE_DROP_HOPS, &queue->data);
+        HOT_LOGI(TAG, "Message from MAC %02X:%02X:%02X:%02X:%02X:%02X reached the maximum number of hops. Resend to all nodes is canceled.", MAC2STR(queue->data.original_sender_mac));
+        return;
+    }
+    switch (_init_config.flood_mode)
+    {
+    case ZH_NETWORK_FLOOD_COUNTER:
+        queue->id = WAIT_FLOOD;
+        queue->time = esp_timer_get_time() / 1000;
+        if (_flood_add(queue) == true)
+        {
+            return;
+        }
+        break;
+    case ZH_NETWORK_FLOOD_GOSSIP:
+        if (esp_random() % 100 >= _init_config.flood_probability)
+        {
+            HOT_LOGI(TAG, "Message from MAC %02X:%02X:%02X:%02X:%02X:%02X is not selected for resend to all nodes.", MAC2STR(queue->data.original_sender_mac));
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+    _flood_send(queue);
+}
+
+static void _flood_send(_queue_t *queue)
+{
+    queue->id = TO_SEND;
+    if (_queue_push(queue) == true)
+    {
+        _stats_inc_type(_stats.forwarded, queue->data.message_type);
+    }
+}
+
+static bool _flood_add(const _queue_t *queue)
+{
+    for (uint8_t i = 0; i < _init_config.flood_table_size; ++i)
+    {
+        _pending_t *pending = &_flood_table[i];
+        if (pending->is_used == false)
+        {
+            pending->queue = *queue;
+            pending->deadline = queue->time + esp_random() % (_init_config.flood_max_delay + 1);
+            pending->is_used = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _flood_check_timeouts(void)
+{
+    uint64_t time = esp_timer_get_time() / 1000;
+    for (uint8_t i = 0; i < _init_config.flood_table_size; ++i)
+    {
+        _pending_t *pending = &_flood_table[i];
+        if (pending->is_used == false || pending->deadline >= time)
+        {
+            continue;
+        }
+        pending->is_used = false;
+        uint8_t copies = _id_cache_get_copies(pending->queue.data.original_sender_mac, pending->queue.data.message_id);
+        if (copies >= _init_config.flood_counter_threshold)
+        {
+            HOT_LOGI(TAG, "Message from MAC %02X:%02X:%02X:%02X:%02X:%02X was heard %d times. Resend to all nodes is canceled.", MAC2STR(pending->queue.data.original_sender_mac), copies);
+            continue;
+        }
+        _flood_send(&pending->queue);
+    }
+}
+
+static uint64_t _flood_get_deadline(void)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (uint8_t i = 0; i < _init_config.flood_table_size; ++i)
+    {
+        if (_flood_table[i].is_used == true && _flood_table[i].deadline < deadline)
+        {
+            deadline = _flood_table[i].deadline;
+        }
+    }
+    return deadline;
+}
+
+static void _fragment_send_next(void)
+{
+    for (uint8_t i = 0; i < _init_config.fragment_table_size; ++i)
+    {
+        _fragment_tx_t *fragment_tx = &_fragment_tx_table[i];
+        if (fragment_tx->state != FRAGMENT_SENDING)
+        {
+            continue;
+        }
+        while (fragment_tx->index < fragment_tx->count && uxQueueSpacesAvailable(_queue_handle) > _init_config.queue_size / 2)
+        {
+            uint8_t index = fragment_tx->index++;
+            if ((fragment_tx->confirmed & (1UL << index)) != 0)
+            {
+                continue;
+            }
+            _fragment_header_t header = {0};
+            header.transfer_id = fragment_tx->transfer_id;
+            header.data_len = fragment_tx->data_len;
+            header.index = index;
+            header.count = fragment_tx->count;
+            header.is_last = ((fragment_tx->confirmed | FRAGMENT_MASK(index + 1)) == FRAGMENT_MASK(fragment_tx->count));
+            uint16_t offset = index * FRAGMENT_DATA_SIZE;
+            uint16_t size = (fragment_tx->data_len - offset < FRAGMENT_DATA_SIZE) ? fragment_tx->data_len - offset : FRAGMENT_DATA_SIZE;
+            _queue_t queue = {0};
+            queue.id = TO_SEND;
+            queue.data.message_type = FRAGMENT;
+            queue.data.network_id = _init_config.network_id;
+            queue.data.message_id = _get_message_id();
+            memcpy(queue.data.original_target_mac, fragment_tx->target_mac, 6);
+            memcpy(queue.data.original_sender_mac, _self_mac, 6);
+            memcpy(queue.data.payload, &header, sizeof(header));
+            memcpy(&queue.data.payload[sizeof(header)], &fragment_tx->data[offset], size);
+            queue.data.payload_len = sizeof(header) + size;
+            if (xQueueSend(_queue_handle, &queue, 0) != pdTRUE)
+            {
+                --fragment_tx->index;
+                break;
+            }
+        }
+        if (fragment_tx->index >= fragment_tx->count)
+        {
+            HOT_LOGI(TAG, "Fragmented message to MAC %02X:%02X:%02X:%02X:%02X:%02X transferred to confirmation message waiting list.", MAC2STR(fragment_tx->target_mac));
+            fragment_tx->deadline = esp_timer_get_time() / 1000 + _init_config.max_waiting_time;
+            fragment_tx->state = FRAGMENT_WAITING;
+        }
+    }
+}
+
+static void _fragment_send_result(_fragment_tx_t *fragment_tx, const bool is_success)
+{
+    zh_network_event_on_send_t on_send = {0};
+    memcpy(on_send.mac_addr, fragment_tx->target_mac, 6);
+    on_send.message_id = fragment_tx->transfer_id;
+    if (is_success == true)
+    {
+        HOT_LOGI(TAG, "Fragmented message to MAC %02X:%02X:%02X:%02X:%02X:%02X sent success.", MAC2STR(fragment_tx->target_mac));
+        on_send.status = ZH_NETWORK_SEND_SUCCESS;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Fragmented message to MAC %02X:%02X:%02X:%02X:%02X:%02X sent fail.", MAC2STR(fragment_tx->target_mac));
+        on_send.status = ZH_NETWORK_SEND_FAIL;
+    }
+    heap_caps_free(fragment_tx->data);
+    fragment_tx->data = NULL;
+    fragment_tx->state = FRAGMENT_FREE;
+    if (_send_notify(&on_send) != true)
+    {
+        ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+    }
+}
+
+static void _fragment_recv(const _message_t *message)
+{
+    _fragment_header_t header = {0};
+    if (message->payload_len <= sizeof(header))
+    {
+        HOT_LOGW(TAG, "Fragmented message from MAC %02X:%02X:%02X:%02X:%02X:%02X discarded. Incorrect fragment size.", MAC2STR(message->original_sender_mac));
+        return;
+    }
+    memcpy(&header, message->payload, sizeof(header));
+    uint16_t offset = header.index * FRAGMENT_DATA_SIZE;
+    uint16_t size = message->payload_len - sizeof(header);
+    if (header.count == 0 || header.count > MAX_FRAGMENT_COUNT || header.index >= header.count || header.data_len > header.count * FRAGMENT_DATA_SIZE || header.data_len <= (header.count - 1) * FRAGMENT_DATA_SIZE || offset + size > header.data_len || (header.index != header.count - 1 && size != FRAGMENT_DATA_SIZE))
+    {
+        HOT_LOGW(TAG, "Fragmented message from MAC %02X:%02X:%02X:%02X:%02X:%02X discarded. Incorrect fragment header.", MAC2STR(message->original_sender_mac));
+        return;
+    }
+    _fragment_rx_t *fragment_rx = NULL;
+    for (uint8_t i = 0; i < _init_config.fragment_table_size; ++i)
+    {
+        _fragment_rx_t *item = &_fragment_rx_table[i];
+        if (item->is_used == true && item->transfer_id == header.transfer_id && memcmp(item->sender_mac, message->original_sender_mac, 6) == 0)
+        {
+            fragment_rx = item;
+            break;
+        }
+        if (item->is_used == false && fragment_rx == NULL)
+        {
+            fragment_rx = item;
+        }
+    }
+    if (fragment_rx == NULL)
+    {
+        HOT_LOGW(TAG, "Fragmented message from MAC %02X:%02X:%02X:%02X:%02X:%02X discarded. Reassembly list is full.", MAC2STR(message->original_sender_mac));
+        return;
+    }
+    if (fragment_rx->is_used == false)
+    {
+        fragment_rx->data = heap_caps_malloc(header.data_len, MALLOC_CAP_8BIT);
+        if (fragment_rx->data == NULL)
+        {
+            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+            return;
+        }
+        memcpy(fragment_rx->sender_mac, message->original_sender_mac, 6);
+        fragment_rx->transfer_id = header.transfer_id;
+        fragment_rx->data_len = header.data_len;
+        fragment_rx->count = header.count;
+        fragment_rx->received = 0;
+        fragment_rx->is_complete = false;
+        fragment_rx->is_used = true;
+    }
+    fragment_rx->deadline = esp_timer_get_time() / 1000 + _init_config.fragment_timeout;
+    if (fragment_rx->is_complete == true)
+    {
+        if (header.is_last == true)
+        {
+            _fragment_confirm_send(fragment_rx);
+        }
+        return;
+    }
+    if (header.count != fragment_rx->count || header.data_len != fragment_rx->data_len)
+    {
+        return;
+    }
+    memcpy(&fragment_rx->data[offset], &message->payload[sizeof(header)], size);
+    fragment_rx->received |= 1UL << header.index;
+    if (fragment_rx->received != FRAGMENT_MASK(fragment_rx->count))
+    {
+        if (header.is_last == true)
+        {
+            _fragment_confirm_send(fragment_rx);
+        }
+        return;
+    }
+    HOT_LOGI(TAG, "Fragmented message from MAC %02X:%02X:%02X:%02X:%02X:%02X is reassembled.", MAC2STR(fragment_rx->sender_mac));
+    fragment_rx->is_complete = true;
+    _fragment_confirm_send(fragment_rx);
+    TRACE(TRACE_DELIVER, message);
+    zh_network_recv_cb_t on_recv_cb = _on_recv_cb;
+    if (on_recv_cb != NULL)
+    {
+        on_recv_cb(fragment_rx->sender_mac, fragment_rx->data, fragment_rx->data_len);
+        heap_caps_free(fragment_rx->data);
+    }
+    else
+    {
+        zh_network_event_on_recv_t on_recv = {0};
+        memcpy(on_recv.mac_addr, fragment_rx->sender_mac, 6);
+        on_recv.data = fragment_rx->data;
+        on_recv.data_len = fragment_rx->data_len;
+        if (esp_event_post(ZH_NETWORK, ZH_NETWORK_ON_RECV_EVENT, &on_recv, sizeof(zh_network_event_on_recv_t), portTICK_PERIOD_MS) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "ESP-NOW message processing task internal error at line %d.", __LINE__);
+            heap_caps_free(fragment_rx->data);
+        }
+    }
+    fragment_rx->data = NULL;
+}
+
+static void _fragment_confirm_send(const _fragment_rx_t *fragment_rx)
+{
+    _fragment_confirm_t confirm = {0};
+    confirm.transfer_id = fragment_rx->transfer_id;
+    confirm.received = fragment_rx->received;
+    _queue_t queue = {0};
+    queue.id = TO_SEND;
+    queue.data.message_type = FRAGMENT_CONFIRM;
+    queue.data.network_id = _init_config.network_id;
+    queue.data.message_id = _get_message_id();
+    memcpy(queue.data.original_target_mac, fragment_rx->sender_mac, 6);
+    memcpy(queue.data.original_sender_mac, _self_mac, 6);
+    memcpy(queue.data.payload, &confirm, sizeof(confirm));
+    queue.data.payload_len = sizeof(confirm);
+    HOT_LOGI(TAG, "System message for fragmented message receiving confirmation to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue.", MAC2STR(fragment_rx->sender_mac));
+    _queue_push(&queue);
+}
+
+static void _fragment_confirm_received(const _message_t *message)
+{
+    _fragment_confirm_t confirm = {0};
+    if (message->payload_len != sizeof(confirm))
+    {
+        return;
+    }
+    memcpy(&confirm, message->payload, sizeof(confirm));
+    for (uint8_t i = 0; i < _init_config.fragment_table_size; ++i)
+    {
+        _fragment_tx_t *fragment_tx = &_fragment_tx_table[i];
+        if ((fragment_tx->state != FRAGMENT_SENDING && fragment_tx->state != FRAGMENT_WAITING) || fragment_tx->transfer_id != confirm.transfer_id || memcmp(fragment_tx->target_mac, message->original_sender_mac, 6) != 0)
+        {
+            continue;
+        }
+        fragment_tx->confirmed |= confirm.received & FRAGMENT_MASK(fragment_tx->count);
+        if (fragment_tx->confirmed == FRAGMENT_MASK(fragment_tx->count))
+        {
+            _fragment_send_result(fragment_tx, true);
+            return;
+        }
+        if (fragment_tx->state == FRAGMENT_WAITING)
+        {
+            if (fragment_tx->attempts >= _init_config.attempts)
+            {
+                _fragment_send_result(fragment_tx, false);
+                return;
+            }
+            HOT_LOGI(TAG, "Fragmented message to MAC %02X:%02X:%02X:%02X:%02X:%02X is partially received. Missing fragments will be repeated.", MAC2STR(fragment_tx->target_mac));
+            ++fragment_tx->attempts;
+            fragment_tx->index = 0;
+            fragment_tx->state = FRAGMENT_SENDING;
+        }
+        return;
+    }
+}
+
+static void _fragment_check_timeouts(void)
+{
+    uint64_t time = esp_timer_get_time() / 1000;
+    for (uint8_t i = 0; i < _init_config.fragment_table_size; ++i)
+    {
+        _fragment_tx_t *fragment_tx = &_fragment_tx_table[i];
+        if (fragment_tx->state == FRAGMENT_WAITING && fragment_tx->deadline < time)
+        {
+            HOT_LOGW(TAG, "Time for waiting confirmation message from MAC %02X:%02X:%02X:%02X:%02X:%02X is expired.", MAC2STR(fragment_tx->target_mac));
+            _stats_inc(&_stats.response_timeouts);
+            if (fragment_tx->attempts >= _init_config.attempts)
+            {
+                _fragment_send_result(fragment_tx, false);
+            }
+            else
+            {
+                ++fragment_tx->attempts;
+                fragment_tx->index = 0;
+                fragment_tx->state = FRAGMENT_SENDING;
+            }
+        }
+        _fragment_rx_t *fragment_rx = &_fragment_rx_table[i];
+        if (fragment_rx->is_used == true && fragment_rx->deadline < time)
+        {
+            if (fragment_rx->is_complete == false)
+            {
+                HOT_LOGW(TAG, "Time for waiting fragments from MAC %02X:%02X:%02X:%02X:%02X:%02X is expired.", MAC2STR(fragment_rx->sender_mac));
+            }
+            heap_caps_free(fragment_rx->data);
+            fragment_rx->data = NULL;
+            fragment_rx->is_used = false;
+        }
+    }
+}
+
+static uint64_t _fragment_get_deadline(void)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (uint8_t i = 0; i < _init_config.fragment_table_size; ++i)
+    {
+        if (_fragment_tx_table[i].state == FRAGMENT_WAITING && _fragment_tx_table[i].deadline < deadline)
+        {
+            deadline = _fragment_tx_table[i].deadline;
+        }
+        if (_fragment_rx_table[i].is_used == true && _fragment_rx_table[i].deadline < deadline)
+        {
+            deadline = _fragment_rx_table[i].deadline;
+        }
+    }
+    return deadline;
+}
+
+static bool _aggregate_add(const _queue_t *queue, const uint8_t *peer_addr)
+{
+    if (_init_config.aggregate_linger == 0 || memcmp(peer_addr, _broadcast_mac, 6) == 0)
+    {
+        return false;
+    }
+    if (queue->data.message_type == UNICAST && memcmp(queue->data.original_sender_mac, _self_mac, 6) == 0 && queue->send_id != queue->data.message_id)
+    {
+        return false; // The ID returned to the application is not kept in packed messages. Messages numbered again are sent separately.
+    }
+    _aggregate_t *aggregate = NULL;
+    for (uint8_t i = 0; i < _init_config.send_window; ++i)
+    {
+        _aggregate_t *item = &_aggregate_table[i];
+        if (item->is_used == true && item->is_flushed == false && memcmp(item->queue.data.original_target_mac, peer_addr, 6) == 0)
+        {
+            aggregate = item;
             break;
-        default:
+        }
+        if (item->is_used == false && aggregate == NULL)
+        {
+            aggregate = item;
+        }
+    }
+    bool is_compact = _compact_is_allowed(&queue->data, peer_addr);
+    uint16_t size = ((is_compact == true) ? COMPACT_HEADER_SIZE : MESSAGE_HEADER_SIZE) + queue->data.payload_len;
+    if (1 + size > ZH_NETWORK_MAX_MESSAGE_SIZE)
+    {
+        if (aggregate != NULL && aggregate->is_used == true)
+        {
+            _aggregate_flush(aggregate);
+        }
+        return false;
+    }
+    if (aggregate == NULL)
+    {
+        return false;
+    }
+    if (aggregate->is_used == true && aggregate->payload_len + 1 + size > aggregate->payload_size)
+    {
+        _aggregate_flush(aggregate);
+        if (aggregate->is_used == true)
+        {
+            return false;
+        }
+    }
+    if (aggregate->is_used == false)
+    {
+        memset(&aggregate->queue, 0, sizeof(_queue_t));
+        aggregate->payload_len = 0;
+        aggregate->payload_size = _aggregate_get_payload_size(peer_addr);
+        aggregate->queue.id = TO_SEND;
+        aggregate->queue.data.message_type = AGGREGATE;
+        aggregate->queue.data.network_id = _init_config.network_id;
+        aggregate->queue.data.message_id = _get_message_id();
+        memcpy(aggregate->queue.data.original_target_mac, peer_addr, 6);
+        memcpy(aggregate->queue.data.original_sender_mac, _self_mac, 6);
+        aggregate->deadline = esp_timer_get_time() / 1000 + _init_config.aggregate_linger;
+        aggregate->is_used = true;
+    }
+    aggregate->payload[aggregate->payload_len] = size;
+    if (is_compact == true)
+    {
+        _compact_encode(&queue->data, &aggregate->payload[aggregate->payload_len + 1]);
+    }
+    else
+    {
+        memcpy(&aggregate->payload[aggregate->payload_len + 1], &queue->data, size);
+    }
+    aggregate->payload_len += 1 + size;
+    HOT_LOGI(TAG, "Outgoing ESP-NOW data from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X packed for sending via MAC %02X:%02X:%02X:%02X:%02X:%02X.", MAC2STR(queue->data.original_sender_mac), MAC2STR(queue->data.original_target_mac), MAC2STR(peer_addr));
+    if (aggregate->payload_len + 1 + MESSAGE_HEADER_SIZE >= aggregate->payload_size)
+    {
+        _aggregate_flush(aggregate);
+    }
+    return true;
+}
+
+static void _aggregate_flush(_aggregate_t *aggregate)
+{
+    HOT_LOGI(TAG, "Packed messages via MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue.", MAC2STR(aggregate->queue.data.original_target_mac));
+    if (MAX_FRAME_SIZE > ESP_NOW_MAX_DATA_LEN && aggregate->payload_len > ZH_NETWORK_MAX_MESSAGE_SIZE) // ESP-NOW v2 frame. The queue gets the message without the payload and the frame stays in the table until sending.
+    {
+        aggregate->is_flushed = true;
+        if (_queue_push(&aggregate->queue) != true)
+        {
+            aggregate->is_flushed = false;
+            aggregate->is_used = false;
+            _aggregate_complete(&aggregate->queue, aggregate->queue.data.original_target_mac, aggregate->payload, aggregate->payload_len, false);
+        }
+        return;
+    }
+    if (aggregate->payload != aggregate->queue.data.payload)
+    {
+        memcpy(aggregate->queue.data.payload, aggregate->payload, aggregate->payload_len);
+    }
+    aggregate->queue.data.payload_len = aggregate->payload_len;
+    aggregate->is_used = false;
+    if (_queue_push(&aggregate->queue) != true)
+    {
+        _aggregate_complete(&aggregate->queue, aggregate->queue.data.original_target_mac, aggregate->queue.data.payload, aggregate->queue.data.payload_len, false);
+    }
+}
+
+static bool _aggregate_take(const uint8_t *peer_addr, _inflight_t *inflight)
+{
+    if (inflight->frame == NULL) // ESP-NOW v2 frames are not supported by this device.
+    {
+        return false;
+    }
+    for (uint8_t i = 0; _aggregate_table != NULL && i < _init_config.send_window; ++i)
+    {
+        _aggregate_t *item = &_aggregate_table[i];
+        if (item->is_used == true && item->is_flushed == true && memcmp(item->queue.data.original_target_mac, peer_addr, 6) == 0)
+        {
+            memcpy(inflight->frame, &item->queue.data, MESSAGE_HEADER_SIZE);
+            memcpy(&inflight->frame[MESSAGE_HEADER_SIZE], item->payload, item->payload_len);
+            inflight->frame_len = MESSAGE_HEADER_SIZE + item->payload_len;
+            item->is_flushed = false;
+            item->is_used = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _aggregate_complete(const _queue_t *queue, const uint8_t *peer_addr, const uint8_t *payload, const uint16_t payload_len, const bool is_success)
+{
+    uint8_t target_mac[6] = {0};
+    memcpy(target_mac, peer_addr, 6); // The peer address may point into the packed message being completed.
+    for (uint16_t offset = 0; offset < payload_len && offset + 1 + payload[offset] <= payload_len; offset += 1 + payload[offset])
+    {
+        _queue_t item = {0};
+        item.id = TO_SEND;
+#ifdef CONFIG_ZH_NETWORK_LATENCY
+        item.stamp = queue->stamp;
+#endif
+        if (payload[offset] == 0)
+        {
+            continue;
+        }
+        if ((payload[offset + 1] & COMPACT_FLAG) != 0) // Compact header. Packed only by the original sender for the next node.
+        {
+            if (_compact_decode(_self_mac, &payload[offset + 1], payload[offset], &item.data) == 0)
+            {
+                continue;
+            }
+            if (memcmp(item.data.original_target_mac, _broadcast_mac, 6) != 0)
+            {
+                memcpy(item.data.original_target_mac, target_mac, 6);
+            }
+        }
+        else
+        {
+            memcpy(&item.data, &payload[offset + 1], (payload[offset] < sizeof(_message_t)) ? payload[offset] : sizeof(_message_t));
+        }
+        item.is_numbered = true;
+        item.send_id = item.data.message_id;
+        _send_complete(&item, target_mac, is_success);
+    }
+}
+
+static void _aggregate_recv(const uint8_t *src_addr, const int8_t rssi, const uint8_t *payload, const uint16_t payload_len)
+{
+    for (uint16_t offset = 0; offset < payload_len && offset + 1 + payload[offset] <= payload_len; offset += 1 + payload[offset])
+    {
+        _recv_frame(src_addr, rssi, &payload[offset + 1], payload[offset], true);
+    }
+}
+
+static uint16_t _aggregate_get_payload_size(const uint8_t *peer_addr)
+{
+    uint16_t max_frame = _link_get(peer_addr)->max_frame;
+    if (MAX_FRAME_SIZE > ESP_NOW_MAX_DATA_LEN && max_frame > ESP_NOW_MAX_DATA_LEN && max_frame <= MAX_FRAME_SIZE)
+    {
+        return max_frame - MESSAGE_HEADER_SIZE;
+    }
+    return ZH_NETWORK_MAX_MESSAGE_SIZE;
+}
+
+static void _aggregate_check_timeouts(void)
+{
+    uint64_t time = esp_timer_get_time() / 1000;
+    for (uint8_t i = 0; _aggregate_table != NULL && i < _init_config.send_window; ++i)
+    {
+        if (_aggregate_table[i].is_used == true && _aggregate_table[i].is_flushed == false && _aggregate_table[i].deadline < time)
+        {
+            _aggregate_flush(&_aggregate_table[i]);
+        }
+    }
+}
+
+static uint64_t _aggregate_get_deadline(void)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (uint8_t i = 0; _aggregate_table != NULL && i < _init_config.send_window; ++i)
+    {
+        if (_aggregate_table[i].is_used == true && _aggregate_table[i].is_flushed == false && _aggregate_table[i].deadline < deadline)
+        {
+            deadline = _aggregate_table[i].deadline;
+        }
+    }
+    return deadline;
+}
+
+static void _ack_add(const _message_t *message)
+{
+    uint64_t time = esp_timer_get_time() / 1000;
+    _ack_t *ack = NULL;
+    for (uint8_t i = 0; i < _init_config.confirm_queue_size; ++i)
+    {
+        _ack_t *item = &_ack_table[i];
+        if (item->is_used == true && memcmp(item->mac_addr, message->original_sender_mac, 6) == 0)
+        {
+            ack = item;
             break;
         }
+        if (ack == NULL || (ack->is_used == true && (item->is_used == false || item->time < ack->time)))
+        {
+            ack = item;
+        }
     }
-    vTaskDelete(NULL);
-}
\ No newline at end of file
+    if (ack->is_used == true && memcmp(ack->mac_addr, message->original_sender_mac, 6) != 0)
+    {
+        if (ack->is_pending == true)
+        {
+            _ack_send(ack);
+        }
+        ack->is_used = false;
+    }
+    ack->time = time;
+    if (ack->is_used == false)
+    {
+        memcpy(ack->mac_addr, message->original_sender_mac, 6);
+        ack->message_id = message->message_id;
+        ack->window = 1;
+        ack->is_used = true;
+    }
+    else
+    {
+        uint32_t offset = message->message_id - ack->message_id;
+        if ((int32_t)offset > 0)
+        {
+            if (ack->is_pending == true && (offset >= ID_WINDOW_SIZE || (ack->window >> (ID_WINDOW_SIZE - offset)) != 0))
+            {
+                _ack_send(ack); // Shifting the window would lose not yet confirmed messages.
+            }
+            ack->window = (offset < ID_WINDOW_SIZE) ? ((ack->window << offset) | 1) : 1;
+            ack->message_id = message->message_id;
+        }
+        else if (-offset < ID_WINDOW_SIZE)
+        {
+            ack->window |= (1UL << -offset);
+        }
+        else
+        {
+            ack->window = 1; // Far behind the window. The node was restarted and has a new message ID sequence.
+            ack->message_id = message->message_id;
+        }
+    }
+    if (ack->is_pending == false)
+    {
+        ack->deadline = time + _init_config.ack_delay;
+        ack->is_pending = true;
+    }
+    if (_init_config.ack_delay == 0)
+    {
+        _ack_send(ack);
+    }
+}
+
+static void _ack_send(_ack_t *ack)
+{
+    _queue_t queue = {0};
+    queue.id = TO_SEND;
+    queue.data.message_type = DELIVERY_CONFIRM;
+    queue.data.network_id = _init_config.network_id;
+    queue.data.message_id = _get_message_id();
+    memcpy(queue.data.original_target_mac, ack->mac_addr, 6);
+    memcpy(queue.data.original_sender_mac, _self_mac, 6);
+    _delivery_confirm_t delivery_confirm = {.message_id = ack->message_id, .window = ack->window};
+    queue.data.payload_len = sizeof(delivery_confirm);
+    memcpy(queue.data.payload, &delivery_confirm, sizeof(delivery_confirm));
+    ack->is_pending = false;
+    HOT_LOGI(TAG, "System message for message receiving confirmation from MAC %02X:%02X:%02X:%02X:%02X:%02X to MAC %02X:%02X:%02X:%02X:%02X:%02X added to queue.", MAC2STR(queue.data.original_sender_mac), MAC2STR(queue.data.original_target_mac));
+    _queue_push(&queue);
+}
+
+static void _ack_check_timeouts(void)
+{
+    uint64_t time = esp_timer_get_time() / 1000;
+    for (uint8_t i = 0; i < _init_config.confirm_queue_size; ++i)
+    {
+        if (_ack_table[i].is_pending == true && _ack_table[i].deadline <= time)
+        {
+            _ack_send(&_ack_table[i]);
+        }
+    }
+}
+
+static uint64_t _ack_get_deadline(void)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (uint8_t i = 0; i < _init_config.confirm_queue_size; ++i)
+    {
+        if (_ack_table[i].is_pending == true && _ack_table[i].deadline < deadline)
+        {
+            deadline = _ack_table[i].deadline;
+        }
+    }
+    return deadline;
+}
+
+static bool _origin_admit(const _message_t *message)
+{
+    if (memcmp(message->original_sender_mac, _self_mac, 6) == 0)
+    {
+        return true;
+    }
+    _origin_t *origin = NULL;
+    _origin_t *free_origin = NULL;
+    uint8_t active = 0;
+    for (uint8_t i = 0; i < _init_config.forward_queue_size; ++i)
+    {
+        _origin_t *item = &_origin_table[i];
+        if (item->is_used == true && memcmp(item->mac_addr, message->original_sender_mac, 6) == 0)
+        {
+            origin = item;
+        }
+        if (item->is_used == true && item->queued != 0)
+        {
+            ++active;
+        }
+        else if (free_origin == NULL || (free_origin->is_used == true && (item->is_used == false || item->time < free_origin->time)))
+        {
+            free_origin = item;
+        }
+    }
+    uint64_t time = esp_timer_get_time() / 1000;
+    if (origin == NULL)
+    {
+        if (free_origin == NULL)
+        {
+            return false;
+        }
+        origin = free_origin;
+        memcpy(origin->mac_addr, message->original_sender_mac, 6);
+        origin->queued = 0;
+        origin->credit = _init_config.forward_rate_limit * 1000;
+        origin->time = time;
+        origin->is_used = true;
+    }
+    if (_init_config.forward_rate_limit != 0)
+    {
+        uint64_t credit = origin->credit + (time - origin->time) * _init_config.forward_rate_limit;
+        origin->credit = (credit > _init_config.forward_rate_limit * 1000) ? _init_config.forward_rate_limit * 1000 : credit;
+        if (origin->credit < 1000)
+        {
+            origin->time = time;
+            return false;
+        }
+    }
+    origin->time = time;
+    if (uxQueueSpacesAvailable(_forward_queue_handle) <= _init_config.forward_queue_size / 2) // The share is checked only when the queue is at least half full.
+    {
+        if (origin->queued == 0)
+        {
+            ++active;
+        }
+        if (origin->queued >= _init_config.forward_queue_size / active)
+        {
+            return false;
+        }
+    }
+    if (_init_config.forward_rate_limit != 0)
+    {
+        origin->credit -= 1000;
+    }
+    ++origin->queued;
+    return true;
+}
+
+static void _origin_release(const _message_t *message)
+{
+    if (memcmp(message->original_sender_mac, _self_mac, 6) == 0)
+    {
+        return;
+    }
+    for (uint8_t i = 0; i < _init_config.forward_queue_size; ++i)
+    {
+        _origin_t *item = &_origin_table[i];
+        if (item->is_used == true && item->queued != 0 && memcmp(item->mac_addr, message->original_sender_mac, 6) == 0)
+        {
+            --item->queued;
+            return;
+        }
+    }
+}
+
+static void _group_get_mac(const uint16_t group_id, uint8_t *mac_addr)
+{
+    memcpy(mac_addr, _group_mac_prefix, 4);
+    mac_addr[4] = group_id >> 8;
+    mac_addr[5] = group_id & 0xFF;
+}
+
+static bool _group_is_mac(const uint8_t *mac_addr)
+{
+    return memcmp(mac_addr, _group_mac_prefix, 4) == 0;
+}
+
+static bool _group_is_member(const uint8_t *mac_addr)
+{
+    bool is_member = false;
+    uint16_t group_id = (mac_addr[4] << 8) | mac_addr[5];
+    ENTER_CRITICAL();
+    for (uint8_t i = 0; i < _group_count; ++i)
+    {
+        if (_group_table[i] == group_id)
+        {
+            is_member = true;
+            break;
+        }
+    }
+    EXIT_CRITICAL();
+    return is_member;
+}
+
+static bool _compact_is_allowed(const _message_t *message, const uint8_t *peer_addr)
+{
+    if (_init_config.compact_header == false || message->hop_count != 0 || memcmp(message->original_sender_mac, _self_mac, 6) != 0)
+    {
+        return false;
+    }
+    return memcmp(message->original_target_mac, peer_addr, 6) == 0; // The next node is the original target. For broadcast both are the broadcast MAC.
+}
+
+static uint16_t _compact_encode(const _message_t *message, uint8_t *frame)
+{
+    _compact_message_t *compact = (_compact_message_t *)frame;
+    compact->message_type = message->message_type | COMPACT_FLAG;
+    if (memcmp(message->original_target_mac, _broadcast_mac, 6) == 0)
+    {
+        compact->message_type |= COMPACT_BROADCAST_FLAG;
+    }
+    compact->network_id = message->network_id;
+    compact->message_id = message->message_id;
+    compact->delivery_mode = message->delivery_mode;
+    compact->payload_len = message->payload_len;
+    memcpy(compact->payload, message->payload, message->payload_len);
+    return COMPACT_HEADER_SIZE + message->payload_len;
+}
+
+static uint16_t _compact_decode(const uint8_t *src_addr, const uint8_t *frame, const int frame_len, _message_t *message)
+{
+    const _compact_message_t *compact = (const _compact_message_t *)frame;
+    if (frame_len < COMPACT_HEADER_SIZE || compact->payload_len > ZH_NETWORK_MAX_MESSAGE_SIZE || frame_len != COMPACT_HEADER_SIZE + compact->payload_len)
+    {
+        return 0;
+    }
+    message->message_type = compact->message_type & ~(COMPACT_FLAG | COMPACT_BROADCAST_FLAG);
+    message->network_id = compact->network_id;
+    message->message_id = compact->message_id;
+    memcpy(message->original_target_mac, ((compact->message_type & COMPACT_BROADCAST_FLAG) != 0) ? _broadcast_mac : _self_mac, 6);
+    memcpy(message->original_sender_mac, src_addr, 6);
+    message->hop_count = 0;
+    message->delivery_mode = compact->delivery_mode;
+    message->payload_len = compact->payload_len;
+    memcpy(message->payload, compact->payload, compact->payload_len);
+    return MESSAGE_HEADER_SIZE + compact->payload_len;
+}
+
+#ifdef CONFIG_ZH_NETWORK_LATENCY
+static void _latency_add(const zh_network_latency_stage_t stage, const _queue_t *queue)
+{
+    uint8_t message_type = queue->data.message_type;
+    if (queue->stamp == 0 || message_type >= ZH_NETWORK_MESSAGE_TYPE_MAX)
+    {
+        return;
+    }
+    int64_t latency = esp_timer_get_time() - queue->stamp;
+    uint8_t bucket = 0;
+    while (latency > 1 && bucket < ZH_NETWORK_LATENCY_BUCKETS - 1)
+    {
+        latency >>= 1;
+        ++bucket;
+    }
+    ENTER_CRITICAL();
+    ++_latency.bucket[stage][message_type][bucket];
+    EXIT_CRITICAL();
+}
+#endif
+
+#ifdef CONFIG_ZH_NETWORK_TRACE
+static void _trace_add(const _trace_event_t event, const _message_t *message)
+{
+    ENTER_CRITICAL();
+    _trace_t *trace = &_trace_ring[_trace_head];
+    trace->time = esp_timer_get_time() / 1000;
+    trace->message_id = message->message_id;
+    trace->event = event;
+    trace->message_type = message->message_type;
+    trace->hop_count = message->hop_count;
+    memcpy(trace->original_sender_mac, message->original_sender_mac, 6);
+    memcpy(trace->original_target_mac, message->original_target_mac, 6);
+    memcpy(trace->sender_mac, message->sender_mac, 6);
+    _trace_head = (_trace_head + 1) % CONFIG_ZH_NETWORK_TRACE_SIZE;
+    if (_trace_count < CONFIG_ZH_NETWORK_TRACE_SIZE)
+    {
+        ++_trace_count;
+    }
+    EXIT_CRITICAL();
+}
+#endif